@@ -0,0 +1,34 @@
+#----------------------------------------------------------
+#    This is Airin 4, an advanced WebSocket chat server
+# Licensed under the new BSD 3-Clause license, see LICENSE
+#       Made by Asterleen ~ https://asterleen.com
+#
+#----------------------------------------------------------
+#
+# Benchmarks of server internals on synthetic data,
+# they never touch a running server or its database.
+# Usage: airinbench <benchmark> [--rounds N], see --help
+#
+#----------------------------------------------------------
+
+
+QT       += core network websockets
+
+QT       -= gui
+
+TARGET = airinbench
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../src
+
+
+SOURCES += main.cpp \
+    ../src/airinclient.cpp \
+    ../src/airinframe.cpp
+
+HEADERS += \
+    ../src/airinclient.h \
+    ../src/airinframe.h
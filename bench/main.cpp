@@ -0,0 +1,327 @@
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QTextStream>
+#include <QUrl>
+#include <QWebSocket>
+#include <QWebSocketServer>
+
+#include "airinclient.h"
+#include "airinframe.h"
+
+static QTextStream out(stdout);
+
+// Lets sockets do their job for a while, nothing is measured here
+static void settle(qint64 ms)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    while (timer.elapsed() < ms)
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+}
+
+// Synthetic clients: real WebSocket connections over loopback, the server side
+// of each one is an AirinClient just like AirinServer::serverNewConnection() makes
+static bool connectClients(QWebSocketServer *server, int count,
+                           QList<QWebSocket *> *remotes, QList<AirinClient *> *clients)
+{
+    QUrl url(QString("ws://127.0.0.1:%1").arg(server->serverPort()));
+
+    while (remotes->count() < count)
+    {
+        QWebSocket *remote = new QWebSocket();
+        remote->open(url);
+        remotes->append(remote);
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    while (clients->count() < count && timer.elapsed() < 30000)
+    {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+
+        while (server->hasPendingConnections())
+        {
+            QWebSocket *sock = server->nextPendingConnection();
+            AirinClient *client = new AirinClient(sock);
+
+            sock->setParent(client);
+            client->setApiLevel(4);
+            clients->append(client);
+        }
+    }
+
+    return clients->count() == count;
+}
+
+// Time AirinServer::broadcast() spends on the main thread handing one
+// already serialized line to every client, against the number of clients
+static int benchBroadcast(uint rounds, int maxClients)
+{
+    QWebSocketServer server("airinbench", QWebSocketServer::NonSecureMode);
+    server.setMaxPendingConnections(maxClients);
+
+    if (!server.listen(QHostAddress::LocalHost, 0))
+    {
+        out << "Could not listen on loopback: " << server.errorString() << endl;
+        return 1;
+    }
+
+    QList<QWebSocket *> remotes;
+    QList<AirinClient *> clients;
+
+    QList<int> steps;
+    steps << 1 << 10 << 50 << 100 << 250 << 500 << 1000 << 2500 << 5000;
+
+    while (!steps.isEmpty() && steps.last() >= maxClients)
+        steps.removeLast();
+
+    steps << maxClients;
+
+    // One line as processMessage() builds it, shared by all the recipients
+    QString message = QString("CONTENT %1 %2 %3 %4 %5 #%6")
+            .arg(100500)
+            .arg(QDateTime::currentDateTime().toTime_t())
+            .arg("Asterleen")
+            .arg("ff8000")
+            .arg("null")
+            .arg("Hello there, this is a chat line of a quite usual length :3");
+
+    out << "Broadcast: " << rounds << " rounds of a " << message.length() << " chars line" << endl;
+    out << "clients\tus per broadcast\tns per client" << endl;
+
+    for (int s = 0; s < steps.count(); s++)
+    {
+        int count = steps.at(s);
+
+        if (!connectClients(&server, count, &remotes, &clients))
+        {
+            out << "Only " << clients.count() << " of " << count
+                << " clients could connect, check the open files limit" << endl;
+            break;
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+
+        for (uint r = 0; r < rounds; r++)
+            for (int i = 0; i < clients.count(); i++)
+                clients.at(i)->writeFrame(message, QByteArray(), true);
+
+        qint64 elapsed = timer.nsecsElapsed();
+
+        out << count << "\t" << elapsed / rounds / 1000 << "\t" << elapsed / rounds / count << endl;
+
+        // Let the lines go out before the next step, so it starts with empty buffers
+        settle(200);
+    }
+
+    qDeleteAll(clients);
+    qDeleteAll(remotes);
+    return 0;
+}
+
+// Chat lines of a usual mix of lengths, made of common words so zlib
+// sees something close to real text. Always the same for the same count.
+static QStringList chatLines(int count)
+{
+    static const char *words[] = {
+        "hello", "there", "this", "is", "a", "chat", "line", "of", "quite", "usual", "length",
+        "what", "do", "you", "think", "about", "it", "lol", "yes", "no", "maybe", "the", "server",
+        "works", "again", "today", "and", "nobody", "knows", "why", ":3", "okay", "see", "later"
+    };
+    const int wordsCount = sizeof(words) / sizeof(words[0]);
+
+    QStringList lines;
+    uint seed = 1;
+
+    for (int i = 0; i < count; i++)
+    {
+        // Most lines are short, every tenth one is a long story
+        seed = seed * 1103515245 + 12345;
+        int length = (i % 10 == 9) ? 400 + (seed >> 16) % 600 : 10 + (seed >> 16) % 120;
+
+        QString text;
+        while (text.length() < length)
+        {
+            seed = seed * 1103515245 + 12345;
+            text += QString(words[(seed >> 16) % wordsCount]) + " ";
+        }
+
+        lines.append(text.trimmed());
+    }
+
+    return lines;
+}
+
+// CPU cost of compressing LOG lines against the bytes it saves,
+// for clients that asked for COMPRESS with the given threshold
+static int benchCompression(uint rounds, uint threshold)
+{
+    QStringList lines = chatLines(100);
+    QStringList frames;
+
+    for (int i = 0; i < lines.count(); i++)
+        frames.append(QString("LOGCON %1 %2 %3 %4 null #%5")
+                      .arg(100500 + i)
+                      .arg(QDateTime::currentDateTime().toTime_t())
+                      .arg("Asterleen")
+                      .arg("ff8000")
+                      .arg(lines.at(i)));
+
+    qint64 rawBytes = 0, sentBytes = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    for (uint r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < frames.count(); i++)
+        {
+            // Exactly what a client with enabled compression would get
+            QByteArray raw = frames.at(i).toUtf8();
+            bool compress = (threshold > 0 && (uint)frames.at(i).length() >= threshold);
+
+            rawBytes += raw.size();
+            sentBytes += compress ? AirinClient::compress(frames.at(i)).size() : raw.size();
+        }
+    }
+
+    qint64 elapsed = timer.nsecsElapsed();
+    qint64 saved = rawBytes - sentBytes;
+
+    out << QString("Compression: %1 frames x %2 rounds, threshold %3, %4 -> %5 bytes per round (%6%), %7 ns CPU per byte saved")
+           .arg(frames.count())
+           .arg(rounds)
+           .arg(threshold)
+           .arg(rawBytes / rounds)
+           .arg(sentBytes / rounds)
+           .arg(rawBytes > 0 ? sentBytes * 100 / rawBytes : 100)
+           .arg(saved > 0 ? QString::number(elapsed / saved) : QString("n/a")) << endl;
+
+    return 0;
+}
+
+// The frame tokenizer against what processClientCommand() did before it,
+// QString::split() and a lookup of the command name, on a usual mix of frames
+static int benchParse(uint rounds)
+{
+    QStringList frames;
+    QStringList lines = chatLines(50);
+
+    for (int i = 0; i < lines.count(); i++)
+        frames.append(QString("CONTENT %1 #%2").arg(i).arg(lines.at(i)));
+
+    frames << "LOG 20" << "LOG BEFORE 100500 50" << "SUS" << "IAM #Asterleen"
+           << "IN main LOG 20 DESC" << "CONNECT 0123456789abcdef0123456789abcdef #Airin Web";
+
+    // Both ways must find the same commands and payloads, it's printed below
+    qint64 splitKnown = 0, splitPayload = 0, frameKnown = 0, framePayload = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    for (uint r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < frames.count(); i++)
+        {
+            const QString &frame = frames.at(i);
+            QStringList words = frame.split(' ', QString::SkipEmptyParts);
+            QString mainCmd = words.at(0).trimmed();
+
+            int command = AirinFrame::CmdUnknown;
+            for (int c = AirinFrame::CmdUnknown + 1; c < AirinFrame::CmdCount && command == AirinFrame::CmdUnknown; c++)
+                if (mainCmd == AirinFrame::commandName((AirinFrame::Command)c))
+                    command = c;
+
+            if (command != AirinFrame::CmdUnknown)
+                splitKnown++;
+
+            if (frame.contains('#'))
+                splitPayload += frame.mid(frame.indexOf('#') + 1).length();
+        }
+    }
+
+    qint64 splitElapsed = qMax(timer.nsecsElapsed(), (qint64)1);
+    timer.restart();
+
+    for (uint r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < frames.count(); i++)
+        {
+            AirinFrame frame(frames.at(i));
+
+            if (frame.command() != AirinFrame::CmdUnknown)
+                frameKnown++;
+
+            framePayload += frame.payload().length();
+        }
+    }
+
+    qint64 frameElapsed = qMax(timer.nsecsElapsed(), (qint64)1);
+    qint64 parsed = (qint64)frames.count() * rounds;
+
+    out << QString("Parse: %1 frames x %2 rounds, split: %3 frames/s, tokenizer: %4 frames/s (%5x faster)")
+           .arg(frames.count())
+           .arg(rounds)
+           .arg(parsed * 1000000000 / splitElapsed)
+           .arg(parsed * 1000000000 / frameElapsed)
+           .arg((double)splitElapsed / frameElapsed, 0, 'f', 1) << endl;
+
+    out << QString("Known commands: split %1, tokenizer %2. Payload chars: split %3, tokenizer %4")
+           .arg(splitKnown).arg(frameKnown).arg(splitPayload).arg(framePayload) << endl;
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Airin benchmarks, all of them run on synthetic data");
+    parser.addHelpOption();
+    parser.addPositionalArgument("benchmark", "One of: broadcast, compression, parse");
+    parser.addOption(QCommandLineOption(QStringList() << "r" << "rounds", "Rounds to run (default 100)", "rounds", "100"));
+    parser.addOption(QCommandLineOption(QStringList() << "clients", "Most synthetic clients for broadcast (default 500)",
+                                        "clients", "500"));
+    parser.addOption(QCommandLineOption(QStringList() << "threshold",
+                                        "compression_min_size for compression, 0 disables it (default 256)",
+                                        "threshold", "256"));
+    parser.process(a);
+
+    bool roundsOk, clientsOk, thresholdOk;
+    uint rounds = parser.value("rounds").toUInt(&roundsOk);
+    int maxClients = parser.value("clients").toInt(&clientsOk);
+    uint threshold = parser.value("threshold").toUInt(&thresholdOk);
+
+    if (parser.positionalArguments().count() != 1 || !roundsOk || rounds == 0
+            || !clientsOk || maxClients <= 0 || !thresholdOk)
+        parser.showHelp(1);
+
+    QString benchmark = parser.positionalArguments().first();
+
+    if (benchmark == "broadcast")
+        return benchBroadcast(rounds, maxClients);
+
+    if (benchmark == "compression")
+        return benchCompression(rounds, threshold);
+
+    if (benchmark == "parse")
+        return benchParse(rounds);
+
+    parser.showHelp(1);
+    return 1;
+}
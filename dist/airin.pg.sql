@@ -72,9 +72,13 @@ CREATE TABLE messages (
     message_text character varying NOT NULL,
     message_visible boolean DEFAULT true NOT NULL,
     message_timestamp timestamp without time zone DEFAULT now() NOT NULL,
-    message_name_color character varying
+    message_name_color character varying,
+    message_room character varying DEFAULT 'main'::character varying NOT NULL
 );
 
+-- Upgrading an existing database? Don't import this file, set 'migrate'
+-- in [database] section of the config and Airin will upgrade it herself.
+
 
 CREATE TABLE server_config (
     conf_name character varying NOT NULL,
@@ -114,4 +118,33 @@ ALTER TABLE ONLY bans
     ADD CONSTRAINT bans_ban_state_fkey FOREIGN KEY (ban_state) REFERENCES ban_states(ban_state_id) ON UPDATE CASCADE;
 
 ALTER TABLE ONLY messages
-    ADD CONSTRAINT messages_message_author_login_fkey FOREIGN KEY (message_author_login) REFERENCES auth(user_id) ON UPDATE CASCADE;
\ No newline at end of file
+    ADD CONSTRAINT messages_message_author_login_fkey FOREIGN KEY (message_author_login) REFERENCES auth(user_id) ON UPDATE CASCADE;
+
+
+-- These are verified on every start, Airin complains loudly if one is missing
+CREATE INDEX idx_messages_room_id ON messages (message_room, message_id);
+CREATE INDEX idx_messages_login_id ON messages (message_author_login, message_id);
+CREATE INDEX idx_auth_internal_token ON auth (internal_token);
+
+-- Old messages are moved here by Airin, see 'archive_after_days' in server_config
+CREATE TABLE messages_archive (
+    message_id integer NOT NULL PRIMARY KEY,
+    message_author_login varchar(255) NOT NULL,
+    message_author_name varchar(255),
+    message_text text NOT NULL,
+    message_visible boolean NOT NULL,
+    message_timestamp timestamp without time zone NOT NULL,
+    message_name_color varchar(32),
+    message_room varchar(32) NOT NULL
+);
+CREATE INDEX idx_messages_archive_room_id ON messages_archive (message_room, message_id);
+
+-- Who has hidden messages, read on start to know who can share cached LOG answers
+CREATE INDEX idx_messages_hidden ON messages (message_author_login) WHERE message_visible = false;
+CREATE INDEX idx_messages_archive_hidden ON messages_archive (message_author_login) WHERE message_visible = false;
+
+-- This dump is already at the latest schema version, see AIRIN_SCHEMA_VERSION
+CREATE TABLE schema_version (
+    version integer NOT NULL
+);
+INSERT INTO schema_version (version) VALUES (4);
\ No newline at end of file
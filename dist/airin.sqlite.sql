@@ -0,0 +1,100 @@
+-- ----------------------------------------------------------
+-- 
+--     This is Airin 4, an advanced WebSocket chat server
+--  Licensed under the new BSD 3-Clause license, see LICENSE
+--        Made by Asterleen ~ https://asterleen.com
+-- 
+-- ----------------------------------------------------------
+-- This is the SQLite compatible database dump for Airin
+-- Create the database file with it and put its path into
+-- 'database' of [database] section with dbms = sqlite:
+--   sqlite3 airin.db < airin.sqlite.sql
+-- Airin switches the file to WAL mode by herself. Needs
+-- SQLite 3.23 or newer (true/false keywords).
+-- ----------------------------------------------------------
+
+
+CREATE TABLE admin_users (
+    id integer PRIMARY KEY,
+    user_login varchar NOT NULL UNIQUE
+);
+
+
+CREATE TABLE auth (
+    internal_token varchar NOT NULL,
+    user_id varchar DEFAULT '0' NOT NULL PRIMARY KEY,
+    active boolean DEFAULT true NOT NULL,
+    misc_info varchar
+);
+
+
+CREATE TABLE ban_states (
+    ban_state_id integer PRIMARY KEY,
+    ban_state_tag varchar UNIQUE,
+    ban_state_description varchar
+);
+
+-- These constants are defined in Airin server.
+-- See 'airindata.h' file, enum AirinBanState
+INSERT INTO ban_states (ban_state_id, ban_state_tag, ban_state_description)
+VALUES
+    (0, 'none', 'Not banned'),
+    (1, 'shadow', 'Shadowbanned (silent mode)'),
+    (2, 'full', 'Full ban, access is restricted');
+
+
+CREATE TABLE bans (
+    ban_id integer PRIMARY KEY,
+    ban_login varchar NOT NULL UNIQUE,
+    ban_comment varchar NOT NULL,
+    ban_state integer REFERENCES ban_states(ban_state_id) ON UPDATE CASCADE
+);
+
+
+-- 'integer PRIMARY KEY' is the rowid, so IDs are assigned just like a sequence does.
+-- Timestamps are UTC text, Airin reads them with strftime('%s', ...)
+CREATE TABLE messages (
+    message_id integer PRIMARY KEY,
+    message_author_login varchar NOT NULL REFERENCES auth(user_id) ON UPDATE CASCADE,
+    message_author_name varchar,
+    message_text varchar NOT NULL,
+    message_visible boolean DEFAULT true NOT NULL,
+    message_timestamp timestamp DEFAULT CURRENT_TIMESTAMP NOT NULL,
+    message_name_color varchar,
+    message_room varchar DEFAULT 'main' NOT NULL
+);
+
+
+CREATE TABLE server_config (
+    conf_name varchar NOT NULL PRIMARY KEY,
+    conf_value varchar
+);
+
+
+-- These are verified on every start, Airin complains loudly if one is missing
+CREATE INDEX idx_messages_room_id ON messages (message_room, message_id);
+CREATE INDEX idx_messages_login_id ON messages (message_author_login, message_id);
+CREATE INDEX idx_auth_internal_token ON auth (internal_token);
+
+-- Old messages are moved here by Airin, see 'archive_after_days' in server_config
+CREATE TABLE messages_archive (
+    message_id integer NOT NULL PRIMARY KEY,
+    message_author_login varchar(255) NOT NULL,
+    message_author_name varchar(255),
+    message_text text NOT NULL,
+    message_visible boolean NOT NULL,
+    message_timestamp timestamp NOT NULL,
+    message_name_color varchar(32),
+    message_room varchar(32) NOT NULL
+);
+CREATE INDEX idx_messages_archive_room_id ON messages_archive (message_room, message_id);
+
+-- Who has hidden messages, read on start to know who can share cached LOG answers
+CREATE INDEX idx_messages_hidden ON messages (message_author_login) WHERE message_visible = false;
+CREATE INDEX idx_messages_archive_hidden ON messages_archive (message_author_login) WHERE message_visible = false;
+
+-- This dump is already at the latest schema version, see AIRIN_SCHEMA_VERSION
+CREATE TABLE schema_version (
+    version integer NOT NULL
+);
+INSERT INTO schema_version (version) VALUES (4);
@@ -0,0 +1,170 @@
+#include "airinauthcache.h"
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QMutexLocker>
+
+AirinAuthCache::AirinAuthCache()
+{
+    clock.start();
+    ttl = 0;
+    maxSize = 0;
+    hitCount = 0;
+    missCount = 0;
+}
+
+void AirinAuthCache::setLimits(uint ttlSeconds, uint maxEntries)
+{
+    QMutexLocker locker(&mutex);
+
+    ttl = (qint64)ttlSeconds * 1000;
+    maxSize = (int)maxEntries;
+
+    clear(sessions);
+    clear(bans);
+    clear(admins);
+}
+
+template <typename T>
+bool AirinAuthCache::find(Cache<T> &cache, const QString &key, T *value)
+{
+    QMutexLocker locker(&mutex);
+
+    if (ttl <= 0)
+        return false;
+
+    typename QHash<QString, Entry<T> >::iterator it = cache.entries.find(key);
+
+    if (it == cache.entries.end() || it.value().expires <= clock.elapsed())
+    {
+        if (it != cache.entries.end())
+            remove(cache, key);
+
+        missCount++;
+        return false;
+    }
+
+    *value = it.value().value;
+    hitCount++;
+    return true;
+}
+
+template <typename T>
+void AirinAuthCache::store(Cache<T> &cache, const QString &key, const T &value)
+{
+    QMutexLocker locker(&mutex);
+
+    if (ttl <= 0 || maxSize <= 0)
+        return;
+
+    qint64 now = clock.elapsed();
+
+    remove(cache, key);
+
+    // Expired ones go first, if it's not enough then the ones that expire soonest.
+    // Each entry is evicted once, so a cold start with lots of CONNECTs stays cheap.
+    while (!cache.byExpiry.isEmpty() &&
+           (cache.byExpiry.begin().key() <= now || cache.entries.count() >= maxSize))
+    {
+        cache.entries.remove(cache.byExpiry.begin().value());
+        cache.byExpiry.erase(cache.byExpiry.begin());
+    }
+
+    Entry<T> entry;
+    entry.value = value;
+    entry.expires = now + ttl;
+
+    cache.entries.insert(key, entry);
+    cache.byExpiry.insert(entry.expires, key);
+}
+
+// Callers hold the mutex
+template <typename T>
+void AirinAuthCache::remove(Cache<T> &cache, const QString &key)
+{
+    typename QHash<QString, Entry<T> >::iterator it = cache.entries.find(key);
+
+    if (it == cache.entries.end())
+        return;
+
+    cache.byExpiry.remove(it.value().expires, key);
+    cache.entries.erase(it);
+}
+
+template <typename T>
+void AirinAuthCache::clear(Cache<T> &cache)
+{
+    cache.entries.clear();
+    cache.byExpiry.clear();
+}
+
+bool AirinAuthCache::session(const QString &internalToken, AirinAuthResult *result)
+{
+    return find(sessions, internalToken, result);
+}
+
+void AirinAuthCache::storeSession(const QString &internalToken, const AirinAuthResult &result)
+{
+    // Unknown tokens are not cached, a fresh web login must work at once
+    if (!result.active || result.userId.isEmpty())
+        return;
+
+    store(sessions, internalToken, result);
+}
+
+void AirinAuthCache::dropSession(const QString &internalToken)
+{
+    QMutexLocker locker(&mutex);
+    remove(sessions, internalToken);
+}
+
+bool AirinAuthCache::banState(const QString &login, AirinBanState *state)
+{
+    return find(bans, login, state);
+}
+
+void AirinAuthCache::storeBanState(const QString &login, AirinBanState state)
+{
+    store(bans, login, state);
+}
+
+bool AirinAuthCache::isAdmin(const QString &login, bool *admin)
+{
+    return find(admins, login, admin);
+}
+
+void AirinAuthCache::storeAdmin(const QString &login, bool admin)
+{
+    store(admins, login, admin);
+}
+
+void AirinAuthCache::dropUser(const QString &login)
+{
+    QMutexLocker locker(&mutex);
+    remove(bans, login);
+    remove(admins, login);
+}
+
+void AirinAuthCache::clear()
+{
+    QMutexLocker locker(&mutex);
+    clear(sessions);
+    clear(bans);
+    clear(admins);
+}
+
+quint64 AirinAuthCache::hits()
+{
+    QMutexLocker locker(&mutex);
+    return hitCount;
+}
+
+quint64 AirinAuthCache::misses()
+{
+    QMutexLocker locker(&mutex);
+    return missCount;
+}
@@ -0,0 +1,78 @@
+#ifndef AIRINAUTHCACHE_H
+#define AIRINAUTHCACHE_H
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QHash>
+#include <QMultiMap>
+#include <QString>
+#include <QMutex>
+#include <QElapsedTimer>
+
+#include "airindata.h"
+
+// Auth sessions, ban states and admin ACL barely ever change, so they are
+// kept in memory for a while. Everything Airin changes herself is
+// invalidated explicitly, changes made by somebody else directly
+// in the database are picked up when the entry expires.
+// Shared by all database connections, so it's locked inside.
+class AirinAuthCache
+{
+public:
+    AirinAuthCache();
+
+    void setLimits(uint ttlSeconds, uint maxEntries); // zero TTL disables the cache
+
+    bool session(const QString &internalToken, AirinAuthResult *result);
+    void storeSession(const QString &internalToken, const AirinAuthResult &result);
+    void dropSession(const QString &internalToken);
+
+    bool banState(const QString &login, AirinBanState *state);
+    void storeBanState(const QString &login, AirinBanState state);
+
+    bool isAdmin(const QString &login, bool *admin);
+    void storeAdmin(const QString &login, bool admin);
+
+    void dropUser(const QString &login); // ban state and ACL
+    void clear();
+
+    quint64 hits();
+    quint64 misses();
+
+private:
+    template <typename T> struct Entry
+    {
+        T value;
+        qint64 expires;
+    };
+
+    // TTL is the same for everything, so the soonest to expire is also the oldest one
+    template <typename T> struct Cache
+    {
+        QHash<QString, Entry<T> > entries;
+        QMultiMap<qint64, QString> byExpiry;
+    };
+
+    Cache<AirinAuthResult> sessions;
+    Cache<AirinBanState> bans;
+    Cache<bool> admins;
+
+    QMutex mutex;
+    QElapsedTimer clock;
+    qint64 ttl; // ms
+    int maxSize;
+
+    quint64 hitCount;
+    quint64 missCount;
+
+    template <typename T> bool find(Cache<T> &cache, const QString &key, T *value);
+    template <typename T> void store(Cache<T> &cache, const QString &key, const T &value);
+    template <typename T> void remove(Cache<T> &cache, const QString &key);
+    template <typename T> void clear(Cache<T> &cache);
+};
+
+#endif // AIRINAUTHCACHE_H
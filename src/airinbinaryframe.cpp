@@ -0,0 +1,43 @@
+#include "airinbinaryframe.h"
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QtEndian>
+
+void AirinBinaryFrame::append(QByteArray *out, RecordType type, int id, uint timestamp, const QString &room,
+                              const QString &name, const QString &color, const QString &login,
+                              const QString &text)
+{
+    QByteArray utf8 = text.toUtf8();
+
+    out->reserve(out->size() + 16 + room.length() + name.length() + color.length() + login.length() + utf8.size());
+
+    out->append((char)type);
+    appendUInt32(out, (quint32)qMax(id, 0));
+    appendUInt32(out, timestamp);
+    appendShortString(out, room);
+    appendShortString(out, name);
+    appendShortString(out, color);
+    appendShortString(out, login);
+    appendUInt32(out, (quint32)utf8.size());
+    out->append(utf8);
+}
+
+void AirinBinaryFrame::appendUInt32(QByteArray *out, quint32 value)
+{
+    uchar bytes[4];
+    qToBigEndian(value, bytes);
+    out->append((const char *)bytes, 4);
+}
+
+void AirinBinaryFrame::appendShortString(QByteArray *out, const QString &s)
+{
+    QByteArray utf8 = s.toUtf8().left(255);
+
+    out->append((char)(uchar)utf8.size());
+    out->append(utf8);
+}
@@ -0,0 +1,44 @@
+#ifndef AIRINBINARYFRAME_H
+#define AIRINBINARYFRAME_H
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QByteArray>
+#include <QString>
+
+// Binary chat lines for clients that asked for them with LEVEL 5 BINARY.
+// A binary WebSocket message holds one or more records back to back,
+// all numbers are big-endian, strings are UTF-8:
+//
+//   u8  type         1 = CONTENT, 2 = LOGCON
+//   u32 message id
+//   u32 timestamp    unix time
+//   u8  + bytes      room
+//   u8  + bytes      name
+//   u8  + bytes      color
+//   u8  + bytes      login, empty if logins are not disclosed
+//   u32 + bytes      message text
+//
+// Short fields are cut to 255 bytes, they are much shorter anyway.
+// Everything else (FAIL, LOGCUR, service frames) stays text.
+class AirinBinaryFrame
+{
+public:
+    enum RecordType {
+        RecordContent = 1,
+        RecordLog = 2
+    };
+
+    static void append(QByteArray *out, RecordType type, int id, uint timestamp, const QString &room,
+                       const QString &name, const QString &color, const QString &login, const QString &text);
+
+private:
+    static void appendUInt32(QByteArray *out, quint32 value);
+    static void appendShortString(QByteArray *out, const QString &s);
+};
+
+#endif // AIRINBINARYFRAME_H
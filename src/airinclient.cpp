@@ -10,15 +10,24 @@ AirinClient::AirinClient(QWebSocket *sock, bool useXffHeader, QObject *parent) :
 {
     authorized = false;
     readonly = false;
-    ready = false;
+    ready = 0;
     adminMode = false;
     shadowBanned = false;
+    pingEnabled = false;
     disconnectEmitted = false;
     chatColorResets = 0;
     colorResetsMax = 0;
     pingMissTolerance = 0;
     pingMisses = -1;
 
+    outboxBytes = 0;
+    inFlightBytes = 0;
+    sendQueueMaxBytes = 0;
+    sendQueueMaxFrames = 0;
+    sendQueuePolicy = SendQueueDropOldest;
+    compressionMinSize = 0;
+    binaryProtocol = 0;
+
     pingTimer = NULL;
 
     setSocket(sock, useXffHeader);
@@ -26,7 +35,7 @@ AirinClient::AirinClient(QWebSocket *sock, bool useXffHeader, QObject *parent) :
 
 AirinClient::~AirinClient()
 {
-    ready = false;
+    ready = 0;
 }
 
 void AirinClient::setSocket(QWebSocket *sock, bool useXffHeader)
@@ -43,8 +52,9 @@ void AirinClient::setSocket(QWebSocket *sock, bool useXffHeader)
     connect(socket, SIGNAL(textMessageReceived(QString)), this, SLOT(sockMessageReceived(QString)));
     connect(socket, SIGNAL(disconnected()), this, SLOT(sockDisconnected()));
     connect(socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(sockError(QAbstractSocket::SocketError)));
+    connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(sockBytesWritten(qint64)));
 
-    ready = true;
+    ready = 1;
 }
 
 void AirinClient::setInitTimeout(uint timeout)
@@ -135,17 +145,34 @@ void AirinClient::setApiLevel(uint apiLevel)
 
 void AirinClient::setPingTimeout(uint time, uint missTolerance)
 {
-    if (pingTimer == NULL)
+    if (!pingEnabled)
     {
+        pingEnabled = true;
         pingMissTolerance = missTolerance;
 
-        pingTimer = new QTimer(this);
-        connect (pingTimer, SIGNAL(timeout()), this, SLOT(pingTimedOut()));
-
-        pingTimer->start(time);
+        // The timer must be created in the thread the client lives in
+        QMetaObject::invokeMethod(this, "startPingTimer", Q_ARG(uint, time));
     }
 }
 
+void AirinClient::setSendQueueLimits(uint maxBytes, uint maxFrames, AirinClient::SendQueuePolicy policy)
+{
+    // Zero means no limit. Set this before the client is handed to an I/O thread.
+    sendQueueMaxBytes = maxBytes;
+    sendQueueMaxFrames = maxFrames;
+    sendQueuePolicy = policy;
+}
+
+void AirinClient::setCompression(uint minSize)
+{
+    compressionMinSize = minSize;
+}
+
+void AirinClient::setBinaryProtocol(bool binary)
+{
+    binaryProtocol = binary ? 1 : 0;
+}
+
 bool AirinClient::resetChatColor()
 {
     if (chatColorResets < colorResetsMax)
@@ -160,10 +187,22 @@ bool AirinClient::resetChatColor()
         return false;
 }
 
-void AirinClient::sendMessage(QString message)
+void AirinClient::sendMessage(const QString &message, bool droppable)
 {
-    if (ready && socket->isValid() && socket->state() == QAbstractSocket::ConnectedState)
-        socket->sendTextMessage(message);
+    if (thread() != QThread::currentThread())
+        QMetaObject::invokeMethod(this, "writeMessage", Qt::QueuedConnection,
+                                  Q_ARG(QString, message), Q_ARG(bool, droppable));
+    else
+        writeMessage(message, droppable);
+}
+
+void AirinClient::sendBinary(const QString &message, const QByteArray &data, bool droppable)
+{
+    if (thread() != QThread::currentThread())
+        QMetaObject::invokeMethod(this, "writeBinary", Qt::QueuedConnection,
+                                  Q_ARG(QString, message), Q_ARG(QByteArray, data), Q_ARG(bool, droppable));
+    else
+        writeBinary(message, data, droppable);
 }
 
 void AirinClient::resetPingMisses()
@@ -173,8 +212,7 @@ void AirinClient::resetPingMisses()
 
 void AirinClient::close()
 {
-    socket->close();
-    this->deleteLater();
+    QMetaObject::invokeMethod(this, "closeSocket");
 }
 
 QString AirinClient::hash()
@@ -234,7 +272,7 @@ bool AirinClient::isReadonly()
 
 bool AirinClient::isReady()
 {
-    return ready;
+    return ready.load() != 0;
 }
 
 uint AirinClient::apiLevel()
@@ -242,6 +280,171 @@ uint AirinClient::apiLevel()
     return protocolApiLevel;
 }
 
+uint AirinClient::compressionThreshold()
+{
+    return compressionMinSize.load();
+}
+
+bool AirinClient::isBinaryProtocol()
+{
+    return binaryProtocol.load() != 0;
+}
+
+QByteArray AirinClient::compress(const QString &message)
+{
+    return qCompress(message.toUtf8());
+}
+
+void AirinClient::writeMessage(const QString &message, bool droppable)
+{
+    writeFrame(message, QByteArray(), droppable);
+}
+
+void AirinClient::writeFrame(const QString &message, const QByteArray &compressed, bool droppable)
+{
+    if (!ready.load() || !socket->isValid() || socket->state() != QAbstractSocket::ConnectedState)
+        return;
+
+    AirinOutgoingFrame frame;
+    frame.text = message;
+    frame.droppable = droppable;
+
+    // Broadcasts come already compressed, everything else is compressed here
+    uint threshold = compressionMinSize.load();
+    if (threshold > 0 && (uint)message.length() >= threshold)
+        frame.compressed = compressed.isEmpty() ? compress(message) : compressed;
+
+    queueFrame(frame);
+}
+
+void AirinClient::writeBinary(const QString &message, const QByteArray &data, bool droppable)
+{
+    if (!ready.load() || !socket->isValid() || socket->state() != QAbstractSocket::ConnectedState)
+        return;
+
+    AirinOutgoingFrame frame;
+    frame.text = message;
+    frame.compressed = data;
+    frame.droppable = droppable;
+
+    queueFrame(frame);
+}
+
+void AirinClient::queueFrame(const AirinOutgoingFrame &frame)
+{
+    if (sendQueueMaxBytes == 0 && sendQueueMaxFrames == 0)
+    {
+        sendFrame(frame);
+        return;
+    }
+
+    outbox.enqueue(frame);
+    outboxBytes += frameSize(frame);
+
+    if (sendQueueOverflows())
+    {
+        if (sendQueuePolicy == SendQueueDisconnect)
+        {
+            evict();
+            return;
+        }
+
+        // Chat lines can be re-requested with LOG, service frames can't.
+        // They are marked when queued, text can't tell them apart (IN <room>, BATCH...)
+        uint dropped = 0;
+        for (int i = 0; i < outbox.count() && sendQueueOverflows(); )
+        {
+            if (outbox.at(i).droppable)
+            {
+                outboxBytes -= frameSize(outbox.at(i));
+                outbox.removeAt(i);
+                dropped++;
+            }
+            else
+                i++;
+        }
+
+        if (dropped > 0)
+            emit sendQueueDropped(dropped);
+
+        if (sendQueueOverflows())
+        {
+            evict();
+            return;
+        }
+    }
+
+    pumpOutbox();
+}
+
+void AirinClient::pumpOutbox()
+{
+    if (!ready.load() || socket->state() != QAbstractSocket::ConnectedState)
+        return;
+
+    while (!outbox.isEmpty() && inFlightBytes < AIRIN_SOCKET_WINDOW)
+    {
+        AirinOutgoingFrame frame = outbox.dequeue();
+        outboxBytes -= frameSize(frame);
+
+        qint64 payload = sendFrame(frame);
+
+        // Server frames are not masked, so the header is 2, 4 or 10 bytes long
+        inFlightBytes += payload + ((payload > 65535) ? 10 : (payload > 125) ? 4 : 2);
+    }
+}
+
+qint64 AirinClient::sendFrame(const AirinOutgoingFrame &frame)
+{
+    if (frame.compressed.isEmpty())
+        return socket->sendTextMessage(frame.text);
+    else
+        return socket->sendBinaryMessage(frame.compressed);
+}
+
+qint64 AirinClient::frameSize(const AirinOutgoingFrame &frame)
+{
+    // That's what the frame costs us in memory while it's waiting
+    return frame.compressed.isEmpty() ? frame.text.size() * (qint64)sizeof(QChar) : frame.compressed.size();
+}
+
+bool AirinClient::sendQueueOverflows()
+{
+    return (sendQueueMaxBytes > 0 && outboxBytes + inFlightBytes > sendQueueMaxBytes) ||
+           (sendQueueMaxFrames > 0 && (uint)outbox.count() > sendQueueMaxFrames);
+}
+
+void AirinClient::evict()
+{
+    outbox.clear();
+    outboxBytes = 0;
+
+    // Goes straight to the socket, the queue is what we're punishing for
+    socket->sendTextMessage("FAIL 208 #You receive messages too slowly, disconnecting");
+    ready = 0;
+
+    emit sendQueueEvicted();
+    closeSocket();
+}
+
+void AirinClient::closeSocket()
+{
+    socket->close();
+
+    // In threaded mode the server deletes us when the socket is really disconnected,
+    // otherwise a queued signal could reach the server after we're gone.
+    if (thread() == QCoreApplication::instance()->thread())
+        this->deleteLater();
+}
+
+void AirinClient::startPingTimer(uint time)
+{
+    pingTimer = new QTimer(this);
+    connect (pingTimer, SIGNAL(timeout()), this, SLOT(pingTimedOut()));
+
+    pingTimer->start(time);
+}
+
 void AirinClient::sockMessageReceived(QString message)
 {
     emit messageReceived(message);
@@ -249,7 +452,7 @@ void AirinClient::sockMessageReceived(QString message)
 
 void AirinClient::sockDisconnected()
 {
-    ready = false;
+    ready = 0;
 
     if (!disconnectEmitted)
     {
@@ -260,7 +463,7 @@ void AirinClient::sockDisconnected()
 
 void AirinClient::sockError(QAbstractSocket::SocketError error)
 {
-    ready = false;
+    ready = 0;
 
     Q_UNUSED(error);
     if (!disconnectEmitted)
@@ -270,18 +473,32 @@ void AirinClient::sockError(QAbstractSocket::SocketError error)
     }
 }
 
+void AirinClient::sockBytesWritten(qint64 bytes)
+{
+    // Control frames are counted here too, so this is approximate
+    inFlightBytes = qMax(inFlightBytes - bytes, (qint64)0);
+    pumpOutbox();
+}
+
 void AirinClient::initTimedOut()
 {
+    // Nothing may be emitted after 'disconnected', the server could have deleted us already
+    if (disconnectEmitted)
+        return;
+
     emit initTimeout();
 }
 
 void AirinClient::pingTimedOut()
 {
-    pingMisses++;
+    if (disconnectEmitted)
+        return;
+
+    int misses = pingMisses.fetchAndAddOrdered(1) + 1;
 
     emit pingTimeout();
 
-    if ((uint)pingMisses >= pingMissTolerance)
+    if ((uint)misses >= pingMissTolerance)
         emit pingMissed();
 }
 
@@ -13,6 +13,23 @@
 #include <QCryptographicHash>
 #include <QDateTime>
 #include <QTimer>
+#include <QQueue>
+#include <QThread>
+#include <QAtomicInt>
+#include <QCoreApplication>
+
+// That much of outgoing data may be given to the socket at once,
+// the rest waits in client's own queue where it still can be dropped
+#define AIRIN_SOCKET_WINDOW 65536
+
+// A frame waiting in the client's queue. If 'compressed' is set (zlib text
+// or binary protocol records) it goes as a binary message, the text is kept
+// for bookkeeping.
+struct AirinOutgoingFrame {
+    QString text;
+    QByteArray compressed;
+    bool droppable; // a chat line that can be re-requested with LOG
+};
 
 class AirinClient : public QObject
 {
@@ -28,6 +45,12 @@ public:
         BanShadow
     };
 
+    enum SendQueuePolicy
+    {
+        SendQueueDropOldest, // drop the oldest chat lines waiting to be sent
+        SendQueueDisconnect  // drop the client itself
+    };
+
     void setSocket (QWebSocket *sock, bool useXffHeader);
     void setInitTimeout (uint timeout);
     void setSalt(QString salt);
@@ -43,10 +66,14 @@ public:
     void setColorResetsMax(uint max);
     void setApiLevel(uint apiLevel);
     void setPingTimeout (uint time, uint missTolerance);
+    void setSendQueueLimits (uint maxBytes, uint maxFrames, SendQueuePolicy policy);
+    void setCompression (uint minSize); // 0 disables compression
+    void setBinaryProtocol (bool binary);
 
     bool resetChatColor();
 
-    void sendMessage(QString message);
+    void sendMessage(const QString &message, bool droppable = false); // droppable: a chat line, see setSendQueueLimits()
+    void sendBinary(const QString &message, const QByteArray &data, bool droppable = false); // 'message' is the text it stands for
     void resetPingMisses();
     void close();
 
@@ -63,6 +90,12 @@ public:
     bool isReadonly();
     bool isReady();
     uint apiLevel();
+    uint compressionThreshold();
+    bool isBinaryProtocol();
+
+    // Compressed frame is a binary message: 4-byte big-endian length of
+    // the UTF-8 text followed by its zlib stream (that's what qCompress does)
+    static QByteArray compress(const QString &message);
 
 
 private:
@@ -84,22 +117,55 @@ private:
 
     bool authorized;
     bool readonly;
-    bool ready;
     bool adminMode;
     bool shadowBanned;
-    int pingMisses;
+    bool pingEnabled;
+
+    // These are touched both by the main thread and by the I/O worker one
+    QAtomicInt ready;
+    QAtomicInt pingMisses;
+
     uint chatColorResets;
     uint colorResetsMax;
     uint pingMissTolerance;
 
     bool disconnectEmitted;
 
+    // Outgoing queue, owned by the thread the client lives in
+    QQueue<AirinOutgoingFrame> outbox;
+    qint64 outboxBytes;
+    qint64 inFlightBytes;
+    uint sendQueueMaxBytes;
+    uint sendQueueMaxFrames;
+    SendQueuePolicy sendQueuePolicy;
+
+    QAtomicInt compressionMinSize;
+    QAtomicInt binaryProtocol;
+
+    void queueFrame(const AirinOutgoingFrame &frame);
+    void pumpOutbox();
+    qint64 sendFrame(const AirinOutgoingFrame &frame);
+    qint64 frameSize(const AirinOutgoingFrame &frame);
+    bool sendQueueOverflows();
+    void evict();
+
     uint protocolApiLevel;
 
+public slots:
+    // Sockets can only be used from the thread they live in.
+    // sendMessage() and close() will forward the call there if needed.
+    void writeMessage(const QString &message, bool droppable = false);
+    void writeFrame(const QString &message, const QByteArray &compressed, bool droppable = false);
+    void writeBinary(const QString &message, const QByteArray &data, bool droppable = false);
+
 private slots:
+    void closeSocket();
+    void startPingTimer(uint time);
+
     void sockMessageReceived (QString message);
     void sockDisconnected();
     void sockError (QAbstractSocket::SocketError error);
+    void sockBytesWritten (qint64 bytes);
 
     void initTimedOut();
     void pingTimedOut();
@@ -111,6 +177,8 @@ signals:
     void pingTimeout();
     void pingMissed();
     void disconnected();
+    void sendQueueDropped(uint frames);
+    void sendQueueEvicted();
 
 
 };
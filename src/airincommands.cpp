@@ -249,6 +249,33 @@ bool AirinCommands::process(QString commandLine, AirinClient *client, AirinServe
                     .arg(AIRIN_VERSION)
                     .arg(server->clientsCount())
                     .arg(dup));
+        sendClientResponse(client,
+                    QString("Slow clients: %1 evicted, %2 chat lines dropped.")
+                    .arg(server->sendQueueEvictions())
+                    .arg(server->sendQueueDrops()));
+        sendClientResponse(client,
+                    QString("History buffer: %1 LOG requests served from memory, %2 went to the database.")
+                    .arg(server->historyHits())
+                    .arg(server->historyMisses()));
+        sendClientResponse(client,
+                    QString("LOG cache: %1 answers shared, %2 built.")
+                    .arg(server->logCacheHits())
+                    .arg(server->logCacheMisses()));
+        quint64 authHits = AirinDatabase::authCacheHits(), authMisses = AirinDatabase::authCacheMisses();
+        sendClientResponse(client,
+                    QString("Auth cache: %1 hits, %2 misses (%3% served from memory).")
+                    .arg(authHits)
+                    .arg(authMisses)
+                    .arg((authHits + authMisses > 0) ? authHits * 100 / (authHits + authMisses) : 0));
+        sendClientResponse(client,
+                    QString("SQL statements: %1 calls reused a prepared one, %2 had to prepare it.")
+                    .arg(AirinDatabase::statementCacheHits())
+                    .arg(AirinDatabase::statementCacheMisses()));
+
+        if (AirinDatabase::db->hasReplica())
+            sendClientResponse(client, AirinDatabase::db->replicaReady()
+                               ? "Read replica is up, history and lookups are read from it."
+                               : "Read replica is DOWN, everything is read from the primary database.");
         return true;
     }
 
@@ -521,7 +548,7 @@ bool AirinCommands::process(QString commandLine, AirinClient *client, AirinServe
                 else
             if (commands[1] == "hash")
             {
-                server->disconnectClientsByXId(commands[2]);
+                server->disconnectClientsByHash(commands[2]);
                 sendClientResponse(client, "Disconnected all clients by hash");
             }
                 else
@@ -599,8 +626,10 @@ bool AirinCommands::process(QString commandLine, AirinClient *client, AirinServe
             {
                 if (AirinDatabase::db->setMessageStatus(messageId, false))
                 {
+                    server->setMessageVisible(message, false);
+
                     // This method requires API level 3 and will be sent only to those who use it
-                    server->messageBroadcast(QString("REMCON %1 #Remove me plz").arg(messageId), 3);
+                    server->messageBroadcast(QString("REMCON %1 #Remove me plz").arg(messageId), 3, message.room);
 
                     sendClientResponse(client, QString("Successfully removed message %1.").arg(messageId));
                 }
@@ -613,7 +642,10 @@ bool AirinCommands::process(QString commandLine, AirinClient *client, AirinServe
             if (commands[2] == "restore")
             {
                 if (AirinDatabase::db->setMessageStatus(messageId, true))
+                {
+                    server->setMessageVisible(message, true);
                     sendClientResponse(client, QString("Successfully restored message %1.").arg(messageId));
+                }
                 else
                     sendClientResponse(client, QString("Could not restore message %1!").arg(messageId));
 
@@ -738,6 +770,12 @@ bool AirinCommands::process(QString commandLine, AirinClient *client, AirinServe
 
 void AirinCommands::sendClientResponse(AirinClient *client, QString message,
                                       AirinCommands::UserCmdResponse responseType)
+{
+    client->sendMessage(clientResponse(message, responseType, client->apiLevel()));
+}
+
+QString AirinCommands::clientResponse(QString message, AirinCommands::UserCmdResponse responseType,
+                                      uint apiLevel)
 {
     QString mode, color;
     switch (responseType)
@@ -748,28 +786,23 @@ void AirinCommands::sendClientResponse(AirinClient *client, QString message,
         default : mode = "INFO"; color = "00FFFF";
     }
 
-    if (client->apiLevel() >= 2)
-        client->sendMessage(QString("SERVICE %1 #%2").arg(mode).arg(message));
+    if (apiLevel >= 2)
+        return QString("SERVICE %1 #%2").arg(mode).arg(message);
     else
-        client->sendMessage(QString ("CONTENT 0 1452281488 *AirinService %1 #%2").arg(color).arg(message));
+        return QString ("CONTENT 0 1452281488 *AirinService %1 #%2").arg(color).arg(message);
 }
 
 void AirinCommands::serviceBroadcast(AirinServer *server, QString message,
                                      AirinCommands::UserCmdResponse responseType,
                                      QString login)
 {
-    QList<AirinClient *> clients = server->getClients();
+    // Both variants are built once, not for every client
+    AirinBroadcast payload(clientResponse(message, responseType, 2));
+    payload.legacyMessage = clientResponse(message, responseType, 1);
+    payload.legacyLevel = 2;
+    payload.authorizedOnly = false;
 
-    for (int i = 0; i < clients.count(); i++)
-    {
-        if (!login.isEmpty())
-        {
-            if (clients.at(i)->externalId() != login)
-                continue;
-        }
-
-        sendClientResponse(clients.at(i), message, responseType);
-    }
+    server->broadcast(payload, login);
 }
 
 int AirinCommands::parseMessageId(QString id)
@@ -783,7 +816,8 @@ int AirinCommands::parseMessageId(QString id)
 
 QStringList AirinCommands::getClientStats(AirinServer *server, uint *duplicates)
 {
-    QStringList scannedIds, toReturn;
+    QStringList toReturn;
+    QSet<QString> scannedIds;
     *duplicates = 0;
 
 
@@ -812,14 +846,14 @@ QStringList AirinCommands::getClientStats(AirinServer *server, uint *duplicates)
                 .arg(clients.at(i)->app())
                 .arg(clients.at(i)->hash());
 
-        if (scannedIds.indexOf(clients.at(i)->externalId()) > -1)
+        if (scannedIds.contains(clients.at(i)->externalId()))
         {
             (*duplicates)++;
             clientData.append(" [DUPLICATE]");
         }
             else
         {
-            scannedIds.append(clients.at(i)->externalId());
+            scannedIds.insert(clients.at(i)->externalId());
         }
 
         toReturn.append(clientData);
@@ -12,6 +12,7 @@
 #include <QStringList>
 #include <QDateTime>
 #include <QList>
+#include <QSet>
 #include <QProcess>
 #include <QCoreApplication>
 #include <QTimer>
@@ -42,6 +43,9 @@ public:
     static void sendClientResponse(AirinClient *client, QString message,
                                   UserCmdResponse responseType = UCR_INFO);
 
+    // Builds the response frame as it should be seen by a client of specified API level
+    static QString clientResponse(QString message, UserCmdResponse responseType, uint apiLevel);
+
     // Broadcasts specified message to all clients or selective when 'login' is specified.
     static void serviceBroadcast (AirinServer *server, QString message,
                                   UserCmdResponse responseType = UCR_INFO,
@@ -26,7 +26,17 @@ SOURCES += main.cpp \
     airindatabase.cpp \
     airinclient.cpp \
     airinlogger.cpp \
-    airincommands.cpp
+    airincommands.cpp \
+    airinworker.cpp \
+    airinregistry.cpp \
+    airinmessagewriter.cpp \
+    airinhistory.cpp \
+    airindatabaseworker.cpp \
+    airinauthcache.cpp \
+    airinframe.cpp \
+    airinbinaryframe.cpp \
+    airinlogscheduler.cpp \
+    airinlogcache.cpp
 
 HEADERS += \
     airinserver.h \
@@ -34,4 +44,24 @@ HEADERS += \
     airinclient.h \
     airinlogger.h \
     airindata.h \
-    airincommands.h
+    airincommands.h \
+    airinworker.h \
+    airinregistry.h \
+    airinmessagewriter.h \
+    airinhistory.h \
+    airindatabaseworker.h \
+    airinauthcache.h \
+    airinframe.h \
+    airinbinaryframe.h \
+    airinlogscheduler.h \
+    airinlogcache.h
+
+# Native async PostgreSQL backend (dbms = pgsql-async), needs libpq 14+
+# Build with: qmake CONFIG+=airin_libpq
+airin_libpq {
+    DEFINES += AIRIN_LIBPQ
+    LIBS += -lpq
+
+    SOURCES += airinpgpipeline.cpp
+    HEADERS += airinpgpipeline.h
+}
@@ -8,10 +8,15 @@
 */
 
 #include <QString>
+#include <QStringList>
+#include <QByteArray>
 #include <QDateTime>
 #include <QMap>
 #include "airinclient.h"
 
+// Everyone is in this room unless they leave it
+#define AIRIN_DEFAULT_ROOM "main"
+
 enum LogLevel { // this is for internal logging
     LL_NONE,
     LL_ERROR,
@@ -25,6 +30,12 @@ enum LogOrder { // this is for LOG requests
     LogDescend
 };
 
+enum LogCursor { // LOG BEFORE|AFTER <id> <amount>
+    LogWindow,  // classic LOG <amount> [from], no cursor
+    LogBefore,
+    LogAfter
+};
+
 
 struct AirinMessage {
     int id;
@@ -33,6 +44,7 @@ struct AirinMessage {
     QString message;
     QString color;
     QString login;
+    QString room;
     QDateTime timestamp;
 };
 
@@ -42,6 +54,16 @@ enum AirinBanState {
     BAN_FULL
 };
 
+// Everything CONNECT needs to know about an auth token
+struct AirinAuthResult {
+    QString userId;     // empty or "0" if the token is not valid
+    bool active;        // false if the session was killed
+    QString miscInfo;
+    AirinBanState banState;
+
+    AirinAuthResult() : active(false), banState(BAN_NONE) {}
+};
+
 struct AirinBanEntry {
     QString externalId;
     QString comment;
@@ -50,11 +72,51 @@ struct AirinBanEntry {
     AirinBanState state;
 };
 
+// A broadcast payload is built once and then shared by all its recipients.
+// QString is implicitly shared, so every client gets a reference, not a copy.
+struct AirinBroadcast {
+    QString message;
+    QString legacyMessage;  // sent instead of 'message' to clients below 'legacyLevel'
+    uint legacyLevel;       // 0 = no legacy variant
+    uint minApiLevel;       // 0 = any API level
+    uint maxApiLevel;       // 0 = any API level
+    bool authorizedOnly;    // only authorized and read-only clients get it
+    QString room;           // empty = every client regardless of rooms
+    QByteArray binary;      // sent instead of 'message' to binary protocol clients, if set
+    bool droppable;         // chat lines, slow clients may lose them, see AirinClient::setSendQueueLimits()
+
+    AirinBroadcast(const QString &message = QString(), uint minApiLevel = 0) :
+        message(message), legacyLevel(0), minApiLevel(minApiLevel), maxApiLevel(0), authorizedOnly(true),
+        droppable(false) {}
+};
+
+// A message sent to AirinPgPipeline, waiting for its ID
+struct AirinPendingPost {
+    quint64 clientHandle; // see AirinClientRegistry
+    QString recCode;
+    AirinMessage message;
+};
+
 struct AirinLogRequest {
     AirinClient *client;
+    quint64 clientHandle; // see AirinClientRegistry
     uint amount;
     uint from;
     LogOrder order;
+    LogCursor cursor;
+    QString room;
+    QList<quint64> followers; // clients whose identical requests were merged into this one
+    quint64 cacheGeneration;  // AirinLogCache generation the answer is prepared for
+};
+
+// A LOG answer that is sent in slices, see AirinServer::pumpLogStreams()
+struct AirinLogStream {
+    QString room;
+    LogOrder order;
+    QList<AirinMessage> messages;
+    int sent;
+    QStringList tail; // frames that go after the last message, like LOGCUR
+    QStringList frames; // messages already encoded as text, in sending order; empty = encode on the go
 };
 
 #endif // AIRINDATA_H
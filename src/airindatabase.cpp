@@ -7,6 +7,11 @@
 */
 
 AirinDatabase *AirinDatabase::db = 0;
+QAtomicInt AirinDatabase::lastMessageId(0);
+QAtomicInt AirinDatabase::archivedMessageId(0);
+QAtomicInteger<quint64> AirinDatabase::cacheHits(0);
+QAtomicInteger<quint64> AirinDatabase::cacheMisses(0);
+AirinAuthCache AirinDatabase::authCache;
 
 #define CHECK_DB(toReturn)\
     if (!databaseActive) \
@@ -19,10 +24,14 @@ AirinDatabase *AirinDatabase::db = 0;
             return toReturn;\
         }
 
-AirinDatabase::AirinDatabase(QObject *parent) : QObject(parent)
+AirinDatabase::AirinDatabase(QString connectionName, QObject *parent) : QObject(parent),
+    connectionName(connectionName)
 {
     setDatabaseType(DatabaseMysql);
     databaseActive = false;
+    replica = NULL;
+    replicaRetryTimeout = 5000;
+    replicaRetrying = false;
 }
 
 AirinDatabase::~AirinDatabase()
@@ -30,6 +39,44 @@ AirinDatabase::~AirinDatabase()
 
 }
 
+QString AirinDatabase::driverName(AirinDatabase::DatabaseType dbt)
+{
+    switch (dbt)
+    {
+        case DatabaseMysql :
+            return "QMYSQL";
+
+        case DatabasePostgresql :
+            return "QPSQL";
+
+        case DatabaseSqlite :
+            return "QSQLITE";
+
+        default :
+            return QString();
+    }
+}
+
+AirinDatabase::DatabaseType AirinDatabase::typeByName(QString name, bool *ok)
+{
+    if (ok != NULL)
+        *ok = true;
+
+    if (name == "mysql")
+        return DatabaseMysql;
+
+    if (name == "pgsql")
+        return DatabasePostgresql;
+
+    if (name == "sqlite")
+        return DatabaseSqlite;
+
+    if (ok != NULL)
+        *ok = false;
+
+    return DatabaseMysql;
+}
+
 void AirinDatabase::setDatabaseType(AirinDatabase::DatabaseType dbt)
 {
     dbType = dbt;
@@ -37,18 +84,20 @@ void AirinDatabase::setDatabaseType(AirinDatabase::DatabaseType dbt)
 
 bool AirinDatabase::start(QString host, QString databaseName, QString username, QString password)
 {
-    QString dbName, dbDriver;
+    QString dbName, dbDriver = driverName(dbType);
 
     switch (dbType)
     {
         case DatabaseMysql :
             dbName = "MySQL";
-            dbDriver = "QMYSQL";
             break;
 
         case DatabasePostgresql :
             dbName = "PostgreSQL";
-            dbDriver = "QPSQL";
+            break;
+
+        case DatabaseSqlite :
+            dbName = "SQLite";
             break;
 
         default :
@@ -63,16 +112,21 @@ bool AirinDatabase::start(QString host, QString databaseName, QString username,
     // See https://stackoverflow.com/questions/9519736/warning-remove-database
     QString connection;
     connection = database.connectionName();
+    statements.clear(); // they belong to the old connection and will be prepared again
     database.close();
     database = QSqlDatabase();
     database.removeDatabase(connection);
 
-    database = QSqlDatabase::addDatabase(dbDriver);
+    database = QSqlDatabase::addDatabase(dbDriver, connectionName);
     database.setHostName(host);
     database.setDatabaseName(databaseName);
     database.setUserName(username);
     database.setPassword(password);
 
+    // 'database' is a file name here, host and credentials are ignored
+    if (dbType == DatabaseSqlite)
+        database.setConnectOptions(AIRIN_SQLITE_OPTIONS);
+
     log ("Attempting to connect...", LL_DEBUG);
 
     bool ok = database.open();
@@ -86,20 +140,348 @@ bool AirinDatabase::start(QString host, QString databaseName, QString username,
         databaseActive = true;
 
         log ("Successfully connected to the database! :3", LL_INFO);
+
+        if (dbType == DatabaseSqlite)
+            setupSqlite();
+
         log ("Trying to set up last message ID for further usage...");
-        QSqlQuery qsqLastId;
+        QSqlQuery qsqLastId(database);
         qsqLastId.exec("SELECT message_id FROM messages ORDER BY message_id DESC LIMIT 1");
         qsqLastId.next();
-        lastMessageId = qsqLastId.value("message_id").toInt();
+        raiseLastMessageId(qsqLastId.value("message_id").toInt());
+
+        if (database.tables().contains(AIRIN_ARCHIVE_TABLE))
+        {
+            // The hot table may be almost empty after archival, IDs must go on after the archive
+            QSqlQuery qsqArchived(database);
+            qsqArchived.exec("SELECT MAX(message_id) AS message_id FROM " AIRIN_ARCHIVE_TABLE);
+            qsqArchived.next();
+
+            raiseAtomic(archivedMessageId, qsqArchived.value("message_id").toInt());
+            raiseLastMessageId(archivedMessageId.load());
+        }
 
-        log ((lastMessageId == 0)
+        log ((lastMessageId.load() == 0)
              ? "Last message ID is zero. There's no messages or something went wrong..."
-             : QString("Last message id is %1. It will be increased automatically.").arg(lastMessageId));
+             : QString("Last message id is %1. It will be increased automatically.").arg(lastMessageId.load()));
     }
 
     return ok;
 }
 
+// Every schema change since the first public Airin 4 dump.
+// Each step must be safe on a database that already has its changes.
+struct AirinMigration {
+    int version;
+    const char *description;
+    bool (AirinDatabase::*apply)();
+};
+
+struct AirinIndex {
+    const char *name;
+    const char *table;
+    const char *pgsqlColumns; // SQLite takes them too
+    const char *mysqlColumns; // MySQL can't index long strings without a prefix
+};
+
+static const AirinIndex requiredIndexes[] = {
+    // LOG: id ranges and "last N" inside a room
+    { "idx_messages_room_id", "messages", "message_room, message_id", "message_room(32), message_id" },
+    // LOG: "OR message_author_login = ?" part, /whowas and /ban message
+    { "idx_messages_login_id", "messages", "message_author_login, message_id", "message_author_login(64), message_id" },
+    // CONNECT
+    { "idx_auth_internal_token", "auth", "internal_token", "internal_token(64)" }
+};
+
+bool AirinDatabase::migrate(bool apply)
+{
+    static const AirinMigration migrations[] = {
+        { 1, "message rooms", &AirinDatabase::migrateRooms },
+        { 2, "secondary indexes for LOG, CONNECT and /whowas", &AirinDatabase::migrateIndexes },
+        { 3, "archive table for old messages", &AirinDatabase::migrateArchive },
+        { 4, "index for authors of hidden messages", &AirinDatabase::migrateHiddenIndex }
+    };
+
+    CHECK_DB(false);
+
+    int version = schemaVersion();
+    log (QString("Database schema version is %1, Airin needs %2").arg(version).arg(AIRIN_SCHEMA_VERSION));
+
+    for (uint i = 0; i < sizeof(migrations) / sizeof(migrations[0]); i++)
+    {
+        const AirinMigration &migration = migrations[i];
+
+        if (migration.version <= version)
+            continue;
+
+        if (!apply)
+        {
+            log (QString("Schema migration %1 (%2) is not applied! Set 'migrate' in [database] "
+                         "section to let Airin do it.").arg(migration.version).arg(migration.description),
+                 LL_WARNING);
+            continue;
+        }
+
+        log (QString("Applying schema migration %1: %2...").arg(migration.version).arg(migration.description), LL_INFO);
+
+        if (!(this->*migration.apply)() || !setSchemaVersion(migration.version))
+        {
+            log (QString("Schema migration %1 failed, the database stays at version %2!")
+                 .arg(migration.version).arg(version), LL_ERROR);
+            break;
+        }
+
+        version = migration.version;
+    }
+
+    // A missing index is slow but works, a missing migration breaks queries
+    verifyIndexes();
+
+    return version >= AIRIN_SCHEMA_VERSION;
+}
+
+int AirinDatabase::schemaVersion()
+{
+    if (!database.tables().contains("schema_version"))
+    {
+        QSqlQuery qsqCreate(database);
+        if (!qsqCreate.exec("CREATE TABLE schema_version (version integer NOT NULL)"))
+        {
+            log ("Could not create schema_version table: "+qsqCreate.lastError().text(), LL_WARNING);
+            return 0;
+        }
+    }
+
+    QSqlQuery qsqVersion(database);
+    if (!qsqVersion.exec("SELECT MAX(version) AS version FROM schema_version") || !qsqVersion.next())
+        return 0;
+
+    return qsqVersion.value("version").toInt();
+}
+
+bool AirinDatabase::setSchemaVersion(int version)
+{
+    QSqlQuery qsqVersion(database);
+    qsqVersion.prepare("INSERT INTO schema_version (version) VALUES (?)");
+    qsqVersion.addBindValue(version);
+
+    return qsqVersion.exec();
+}
+
+bool AirinDatabase::indexExists(const QString &name)
+{
+    QSqlQuery qsqIndex(database);
+
+    if (dbType == DatabasePostgresql)
+        qsqIndex.prepare("SELECT 1 FROM pg_indexes WHERE indexname = ?");
+    else
+    if (dbType == DatabaseSqlite)
+        qsqIndex.prepare("SELECT 1 FROM sqlite_master WHERE type = 'index' AND name = ?");
+    else
+        qsqIndex.prepare("SELECT 1 FROM information_schema.statistics "
+                         "WHERE table_schema = DATABASE() AND index_name = ?");
+
+    qsqIndex.addBindValue(name);
+
+    return qsqIndex.exec() && qsqIndex.next();
+}
+
+bool AirinDatabase::verifyIndexes()
+{
+    bool ok = true;
+
+    for (uint i = 0; i < sizeof(requiredIndexes) / sizeof(requiredIndexes[0]); i++)
+    {
+        if (!indexExists(requiredIndexes[i].name))
+        {
+            log (QString("!!! Index %1 on %2 is MISSING, LOG and CONNECT will scan the whole table! !!!")
+                 .arg(requiredIndexes[i].name).arg(requiredIndexes[i].table), LL_ERROR);
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+bool AirinDatabase::migrateRooms()
+{
+    if (database.record("messages").contains("message_room"))
+        return true;
+
+    QSqlQuery qsqRooms(database);
+    if (!qsqRooms.exec("ALTER TABLE messages ADD COLUMN message_room VARCHAR(32) NOT NULL DEFAULT 'main'"))
+    {
+        log ("Could not add message_room column: "+qsqRooms.lastError().text(), LL_ERROR);
+        return false;
+    }
+
+    return true;
+}
+
+bool AirinDatabase::migrateIndexes()
+{
+    for (uint i = 0; i < sizeof(requiredIndexes) / sizeof(requiredIndexes[0]); i++)
+    {
+        const AirinIndex &index = requiredIndexes[i];
+
+        if (indexExists(index.name))
+            continue;
+
+        log (QString("Creating index %1, it may take a while on a big table...").arg(index.name), LL_INFO);
+
+        QSqlQuery qsqIndex(database);
+        if (!qsqIndex.exec(QString("CREATE INDEX %1 ON %2 (%3)")
+                           .arg(index.name)
+                           .arg(index.table)
+                           .arg((dbType == DatabaseMysql) ? index.mysqlColumns : index.pgsqlColumns)))
+        {
+            log (QString("Could not create index %1: %2").arg(index.name).arg(qsqIndex.lastError().text()), LL_ERROR);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool AirinDatabase::migrateArchive()
+{
+    if (database.tables().contains(AIRIN_ARCHIVE_TABLE))
+        return true;
+
+    // Same columns as messages, but IDs are copied, not generated.
+    // MySQL would auto-update a TIMESTAMP column on /message remove, so it's DATETIME there.
+    QSqlQuery qsqArchive(database);
+    if (!qsqArchive.exec(QString("CREATE TABLE " AIRIN_ARCHIVE_TABLE " ("
+                                 "message_id integer NOT NULL PRIMARY KEY, "
+                                 "message_author_login varchar(255) NOT NULL, "
+                                 "message_author_name varchar(255), "
+                                 "message_text text NOT NULL, "
+                                 "message_visible boolean NOT NULL, "
+                                 "message_timestamp %1 NOT NULL, "
+                                 "message_name_color varchar(32), "
+                                 "message_room varchar(32) NOT NULL)")
+                         .arg((dbType == DatabaseMysql) ? "datetime" : "timestamp")))
+    {
+        log ("Could not create the archive table: "+qsqArchive.lastError().text(), LL_ERROR);
+        return false;
+    }
+
+    if (!qsqArchive.exec(QString("CREATE INDEX idx_messages_archive_room_id ON " AIRIN_ARCHIVE_TABLE " (%1)")
+                         .arg((dbType == DatabaseMysql) ? "message_room(32), message_id" : "message_room, message_id")))
+    {
+        log ("Could not index the archive table: "+qsqArchive.lastError().text(), LL_ERROR);
+        return false;
+    }
+
+    return true;
+}
+
+bool AirinDatabase::migrateHiddenIndex()
+{
+    QStringList tables;
+    tables << "messages";
+
+    if (database.tables().contains(AIRIN_ARCHIVE_TABLE))
+        tables << AIRIN_ARCHIVE_TABLE;
+
+    for (int i = 0; i < tables.count(); i++)
+    {
+        QString name = QString("idx_%1_hidden").arg(tables.at(i));
+
+        if (indexExists(name))
+            continue;
+
+        // Hidden messages are few, PostgreSQL and SQLite index only them.
+        // MySQL has no partial indexes, so the flag goes first there.
+        QString definition = (dbType == DatabaseMysql)
+                ? "(message_visible, message_author_login(64))"
+                : "(message_author_login) WHERE message_visible = false";
+
+        QSqlQuery qsqIndex(database);
+        if (!qsqIndex.exec(QString("CREATE INDEX %1 ON %2 %3").arg(name).arg(tables.at(i)).arg(definition)))
+        {
+            log (QString("Could not create index %1: %2").arg(name).arg(qsqIndex.lastError().text()), LL_ERROR);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void AirinDatabase::setupSqlite()
+{
+    // WAL lets LOG readers on other connections work while a message is written,
+    // and with it NORMAL sync is still safe against anything but a power loss
+    QSqlQuery qsqPragma(database);
+
+    if (!qsqPragma.exec("PRAGMA journal_mode = WAL") || !qsqPragma.next()
+        || qsqPragma.value(0).toString().toLower() != "wal")
+        log ("Could not switch SQLite to WAL mode, writes will block readers!", LL_WARNING);
+
+    qsqPragma.exec("PRAGMA synchronous = NORMAL");
+    qsqPragma.exec("PRAGMA foreign_keys = ON");
+}
+
+QString AirinDatabase::timestampColumn()
+{
+    // PostgreSQL gets UNIX_TIMESTAMP from the polyfill in airin.pg.sql,
+    // SQLite stores CURRENT_TIMESTAMP as UTC text
+    if (dbType == DatabaseSqlite)
+        return "CAST(strftime('%s', message_timestamp) AS INTEGER)";
+
+    return "UNIX_TIMESTAMP(message_timestamp)";
+}
+
+void AirinDatabase::setReplica(QString host, QString databaseName, QString username, QString password,
+                               uint retryTimeout)
+{
+    replicaHost = host;
+    replicaName = databaseName;
+    replicaUser = username;
+    replicaPassword = password;
+    replicaRetryTimeout = retryTimeout;
+
+    delete replica;
+    replica = new AirinDatabase(connectionName + "_replica", this);
+    replica->setDatabaseType(dbType);
+    connect (replica, SIGNAL(databaseFailed()), this, SLOT(replicaFailed()));
+
+    startReplica();
+}
+
+bool AirinDatabase::hasReplica()
+{
+    return replica != NULL;
+}
+
+bool AirinDatabase::replicaReady()
+{
+    return replica != NULL && replica->databaseActive;
+}
+
+void AirinDatabase::startReplica()
+{
+    replicaRetrying = false;
+
+    log (QString("Connecting to the read replica on %1@%2...").arg(replicaName).arg(replicaHost), LL_INFO);
+
+    if (!replica->start(replicaHost, replicaName, replicaUser, replicaPassword))
+        replicaFailed();
+}
+
+void AirinDatabase::replicaFailed()
+{
+    // Reads just go to the primary meanwhile, nobody has to wait for the replica
+    if (replicaRetrying)
+        return;
+
+    replicaRetrying = true;
+    log (QString("Read replica is down, using the primary database until it's back (retry in %1 ms)")
+         .arg(replicaRetryTimeout), LL_WARNING);
+
+    QTimer::singleShot(replicaRetryTimeout, this, SLOT(startReplica()));
+}
+
 void AirinDatabase::setDatabaseActive(bool active)
 {
     databaseActive = active;
@@ -135,7 +517,7 @@ QMap<QString, QVariant> AirinDatabase::getServerConfig()
 
     if (databaseActive)
     {
-        QSqlQuery qsqGetConfig;
+        QSqlQuery qsqGetConfig(database);
         if (!qsqGetConfig.exec("SELECT conf_name, conf_value FROM server_config"))
         {
             log ("WARNING! Could not get settings from the database! Using defaults!", LL_WARNING);
@@ -163,8 +545,7 @@ bool AirinDatabase::saveConfigValue(QString key, QString value)
 
     CHECK_DB(false);
 
-    QSqlQuery qsqConfigSave;
-    qsqConfigSave.prepare("SELECT conf_name FROM server_config WHERE conf_name = ?");
+    QSqlQuery qsqConfigSave = prepared("SELECT conf_name FROM server_config WHERE conf_name = ?");
     qsqConfigSave.addBindValue(key);
     if (!qsqConfigSave.exec())
     {
@@ -174,11 +555,14 @@ bool AirinDatabase::saveConfigValue(QString key, QString value)
     }
         else
     {
-        QSqlQuery qsqSaver;
-        if (!qsqConfigSave.next())
+        bool known = qsqConfigSave.next();
+        qsqConfigSave.finish();
+
+        QSqlQuery qsqSaver(database);
+        if (!known)
         {
             log ("Database does not have this parameter, creating new one.");
-            qsqSaver.prepare("INSERT INTO server_config (conf_name, conf_value) VALUES (?, ?)");
+            qsqSaver = prepared("INSERT INTO server_config (conf_name, conf_value) VALUES (?, ?)");
 
             qsqSaver.addBindValue(key);
             qsqSaver.addBindValue(value);
@@ -186,7 +570,7 @@ bool AirinDatabase::saveConfigValue(QString key, QString value)
         else
         {
             log ("This parameter is known, will just update the existing entry.");
-            qsqSaver.prepare("UPDATE server_config SET conf_value = ? WHERE conf_name = ?");
+            qsqSaver = prepared("UPDATE server_config SET conf_value = ? WHERE conf_name = ?");
 
             qsqSaver.addBindValue(value);
             qsqSaver.addBindValue(key);
@@ -207,8 +591,11 @@ AirinBanState AirinDatabase::isUserBanned(QString userLogin)
 {
     CHECK_DB(BAN_NONE);
 
-    QSqlQuery qsqBanCheck;
-    qsqBanCheck.prepare("SELECT * FROM bans WHERE ban_login = ?");
+    AirinBanState state;
+    if (authCache.banState(userLogin, &state))
+        return state;
+
+    QSqlQuery qsqBanCheck = prepared("SELECT * FROM bans WHERE ban_login = ?");
     qsqBanCheck.addBindValue(userLogin);
     if (!qsqBanCheck.exec())
     {
@@ -218,28 +605,33 @@ AirinBanState AirinDatabase::isUserBanned(QString userLogin)
     }
         else
     {
-        if (!qsqBanCheck.next())
+        state = qsqBanCheck.next() ? toBanState(qsqBanCheck.value("ban_state").toInt()) : BAN_NONE;
+        qsqBanCheck.finish();
+
+        authCache.storeBanState(userLogin, state);
+
+        return state;
+    }
+}
+
+AirinBanState AirinDatabase::toBanState(int value)
+{
+    switch (value)
+    {
+        case 0 :
             return BAN_NONE;
-        else
-        {
-            switch (qsqBanCheck.value("ban_state").toInt())
-            {
-                case 0 :
-                    return BAN_NONE;
-                    break;
-                case 1 :
-                    return BAN_SHADOW;
-                    break;
-                case 2 :
-                    return BAN_FULL;
-                    break;
-
-                default :
-                    log ("WARNING: Bad database value! YAEBAL!", LL_WARNING);
-                    return BAN_NONE;
-                    break;
-            }
-        }
+            break;
+        case 1 :
+            return BAN_SHADOW;
+            break;
+        case 2 :
+            return BAN_FULL;
+            break;
+
+        default :
+            log ("WARNING: Bad database value! YAEBAL!", LL_WARNING);
+            return BAN_NONE;
+            break;
     }
 }
 
@@ -247,8 +639,11 @@ bool AirinDatabase::isUserAdmin(QString userLogin)
 {
     CHECK_DB(false);
 
-    QSqlQuery qsqAdminCheck;
-    qsqAdminCheck.prepare("SELECT COUNT(*) AS cnt FROM admin_users WHERE user_login = ?");
+    bool admin;
+    if (authCache.isAdmin(userLogin, &admin))
+        return admin;
+
+    QSqlQuery qsqAdminCheck = prepared("SELECT COUNT(*) AS cnt FROM admin_users WHERE user_login = ?");
     qsqAdminCheck.addBindValue(userLogin);
     if (!qsqAdminCheck.exec())
     {
@@ -259,23 +654,33 @@ bool AirinDatabase::isUserAdmin(QString userLogin)
         else
     {
         qsqAdminCheck.next();
-        return (qsqAdminCheck.value("cnt").toInt() != 0); // this may be incorrect, plz tell me the right way
+        admin = (qsqAdminCheck.value("cnt").toInt() != 0); // this may be incorrect, plz tell me the right way
+        qsqAdminCheck.finish();
+
+        authCache.storeAdmin(userLogin, admin);
+
+        return admin;
     }
 }
 
 
-int AirinDatabase::addMessage(QString authorLogin, QString text, QString name, QString color, bool isVisible)
+int AirinDatabase::addMessage(QString authorLogin, QString text, QString name, QString color, bool isVisible,
+                              QString room)
 {
     CHECK_DB(-1);
 
-    QSqlQuery qsqAdd;
-    qsqAdd.prepare("INSERT INTO messages (message_author_login, message_text, "
-                   "message_author_name, message_name_color, message_visible) VALUES (?,?,?,?,?)");
+    // QPSQL's lastInsertId() is one more round-trip, so Postgres returns the ID right away
+    QString returning = (dbType == DatabasePostgresql) ? " RETURNING message_id" : "";
+
+    QSqlQuery qsqAdd = prepared("INSERT INTO messages (message_author_login, message_text, "
+                                "message_author_name, message_name_color, message_visible, message_room) VALUES (?,?,?,?,?,?)"
+                                + returning);
     qsqAdd.addBindValue(authorLogin);
     qsqAdd.addBindValue(text);
     qsqAdd.addBindValue(name);
     qsqAdd.addBindValue(color);
     qsqAdd.addBindValue(isVisible);
+    qsqAdd.addBindValue(room);
     if (!qsqAdd.exec())
     {
         log ("Could not execute this: "+qsqAdd.lastQuery(), LL_DEBUG);
@@ -284,26 +689,105 @@ int AirinDatabase::addMessage(QString authorLogin, QString text, QString name, Q
     }
     else
     {
-        lastMessageId = qsqAdd.lastInsertId().toInt();
-        return lastMessageId;
+        int messageId = (dbType == DatabasePostgresql)
+                ? (qsqAdd.next() ? qsqAdd.value(0).toInt() : -1)
+                : qsqAdd.lastInsertId().toInt();
+
+        qsqAdd.finish();
+        raiseLastMessageId(messageId);
+        return messageId;
     }
 }
 
-QList<AirinMessage> *AirinDatabase::getMessages(int amount, int from, QString userLogin)
+// Results of the archive and the hot table are glued together, older ones first.
+// If the second part fails, the first one is still worth sending.
+static void appendMessages(QList<AirinMessage> *messages, QList<AirinMessage> *newer)
 {
+    if (newer == NULL)
+        return;
+
+    messages->append(*newer);
+    delete newer;
+}
+
+static QList<AirinMessage> *prependMessages(QList<AirinMessage> *messages, QList<AirinMessage> *older)
+{
+    if (older == NULL)
+        return messages;
+
+    older->append(*messages);
+    delete messages;
+    return older;
+}
+
+QList<AirinMessage> *AirinDatabase::getMessages(int amount, int from, QString userLogin, QString room)
+{
+    if (replicaReady())
+    {
+        QList<AirinMessage> *messages = replica->getMessages(amount, from, userLogin, room);
+        if (messages != NULL)
+            return messages;
+    }
+
     CHECK_DB(NULL);
 
-    from = (from <= 0) ? lastMessageId - amount + 1 : from;
-    QSqlQuery qsqGetMsg;
-    qsqGetMsg.prepare("SELECT message_id, message_author_name, message_name_color, message_author_login, "
-                                  // [!] UNIX_TIMESTAMP needs a custom function in pgsql!
-                      "message_text, UNIX_TIMESTAMP(message_timestamp) as timestamp "
-                      "FROM messages "
-                      "where message_id >= ? AND (message_visible = true OR message_author_login = ?) order by message_id asc LIMIT ?");
+    // "Last N" is always the last N messages the user can see, in every room,
+    // the same as AirinHistory::fetch() answers it
+    int archived = archivedMessageId.load();
 
-    qsqGetMsg.addBindValue(from);
-    qsqGetMsg.addBindValue(userLogin);
-    qsqGetMsg.addBindValue(amount);
+    // A window that starts in the archive may go on in the hot table,
+    // a room tail may need some older messages from the archive
+    if (from > 0 && from <= archived)
+    {
+        QList<AirinMessage> *messages = queryMessages(AIRIN_ARCHIVE_TABLE, amount, from, userLogin, room);
+
+        if (messages != NULL && messages->count() < amount)
+            appendMessages(messages, queryMessages("messages", amount - messages->count(),
+                                                   archived + 1, userLogin, room));
+        return messages;
+    }
+
+    QList<AirinMessage> *messages = queryMessages("messages", amount, from, userLogin, room);
+
+    if (from <= 0 && archived > 0 && messages != NULL && messages->count() < amount)
+        messages = prependMessages(messages, queryMessages(AIRIN_ARCHIVE_TABLE, amount - messages->count(),
+                                                           0, userLogin, room));
+    return messages;
+}
+
+QList<AirinMessage> *AirinDatabase::queryMessages(QString table, int amount, int from, QString userLogin,
+                                                  QString room)
+{
+    QString fields = "message_id, message_author_name, message_name_color, message_author_login, "
+                     "message_text, " + timestampColumn() + " as timestamp ";
+
+    QSqlQuery qsqGetMsg(database);
+
+    if (from <= 0)
+    {
+        // Message IDs are shared by all the rooms, so the last N IDs say nothing
+        // about the last N messages of a small room. Take them in reverse instead.
+        qsqGetMsg = prepared("SELECT * FROM (SELECT " + fields +
+                             "FROM " + table + " "
+                             "where message_room = ? AND (message_visible = true OR message_author_login = ?) "
+                             "order by message_id desc LIMIT ?) AS recent order by message_id asc");
+
+        qsqGetMsg.addBindValue(room);
+        qsqGetMsg.addBindValue(userLogin);
+        qsqGetMsg.addBindValue(amount);
+    }
+    else
+    {
+        qsqGetMsg = prepared("SELECT " + fields +
+                             "FROM " + table + " "
+                             "where message_id >= ? AND message_room = ? AND (message_visible = true OR message_author_login = ?) "
+                             "order by message_id asc LIMIT ?");
+
+        qsqGetMsg.addBindValue(from);
+        qsqGetMsg.addBindValue(room);
+        qsqGetMsg.addBindValue(userLogin);
+        qsqGetMsg.addBindValue(amount);
+    }
 
     if (!qsqGetMsg.exec())
     {
@@ -326,24 +810,336 @@ QList<AirinMessage> *AirinDatabase::getMessages(int amount, int from, QString us
             msg.timestamp = QDateTime::fromTime_t(qsqGetMsg.value("timestamp").toInt());
             msg.color = qsqGetMsg.value("message_name_color").toString();
             msg.login = qsqGetMsg.value("message_author_login").toString();
+            msg.room = room;
             messages->append(msg);
         }
 
+        qsqGetMsg.finish();
+        return messages;
+    }
+}
+
+QList<AirinMessage> *AirinDatabase::getMessagesPage(int limit, int cursorId, LogCursor direction,
+                                                    QString userLogin, QString room)
+{
+    if (replicaReady())
+    {
+        QList<AirinMessage> *messages = replica->getMessagesPage(limit, cursorId, direction, userLogin, room);
+        if (messages != NULL)
+            return messages;
+    }
+
+    CHECK_DB(NULL);
+
+    // Zero cursor means "from the very end"
+    if (direction != LogAfter && cursorId <= 0)
+        cursorId = INT_MAX;
+
+    int archived = archivedMessageId.load();
+
+    if (direction == LogAfter && cursorId < archived)
+    {
+        QList<AirinMessage> *messages = queryPage(AIRIN_ARCHIVE_TABLE, limit, cursorId, direction, userLogin, room);
+
+        if (messages != NULL && messages->count() < limit)
+            appendMessages(messages, queryPage("messages", limit - messages->count(), qMax(cursorId, archived),
+                                               direction, userLogin, room));
         return messages;
     }
+
+    QList<AirinMessage> *messages = queryPage("messages", limit, cursorId, direction, userLogin, room);
+
+    if (direction == LogBefore && archived > 0 && messages != NULL && messages->count() < limit)
+        messages = prependMessages(messages, queryPage(AIRIN_ARCHIVE_TABLE, limit - messages->count(),
+                                                       qMin(cursorId, archived + 1), direction, userLogin, room));
+    return messages;
+}
+
+QList<AirinMessage> *AirinDatabase::queryPage(QString table, int limit, int cursorId, LogCursor direction,
+                                              QString userLogin, QString room)
+{
+    QString fields = "message_id, message_author_name, message_name_color, message_author_login, "
+                     "message_text, " + timestampColumn() + " as timestamp ";
+
+    // Both go straight through idx_messages_room_id, no matter how deep the page is
+    QSqlQuery qsqPage;
+
+    if (direction == LogAfter)
+    {
+        qsqPage = prepared("SELECT " + fields +
+                           "FROM " + table + " "
+                           "where message_room = ? AND message_id > ? "
+                           "AND (message_visible = true OR message_author_login = ?) "
+                           "order by message_id asc LIMIT ?");
+    }
+    else
+    {
+        qsqPage = prepared("SELECT * FROM (SELECT " + fields +
+                           "FROM " + table + " "
+                           "where message_room = ? AND message_id < ? "
+                           "AND (message_visible = true OR message_author_login = ?) "
+                           "order by message_id desc LIMIT ?) AS page order by message_id asc");
+    }
+
+    qsqPage.addBindValue(room);
+    qsqPage.addBindValue(cursorId);
+    qsqPage.addBindValue(userLogin);
+    qsqPage.addBindValue(limit);
+
+    if (!qsqPage.exec())
+    {
+        log ("Could not execute this: "+qsqPage.lastQuery(), LL_DEBUG);
+        log ("Message page SQL error: "+qsqPage.lastError().text(), LL_WARNING);
+        return NULL;
+    }
+
+    QList<AirinMessage> *messages = new QList<AirinMessage>();
+    while (qsqPage.next())
+    {
+        AirinMessage msg;
+        msg.id = qsqPage.value("message_id").toInt();
+        msg.visible = true; // or it's author's own one, doesn't matter for them
+        msg.message = qsqPage.value("message_text").toString();
+        msg.name = qsqPage.value("message_author_name").toString();
+        msg.timestamp = QDateTime::fromTime_t(qsqPage.value("timestamp").toInt());
+        msg.color = qsqPage.value("message_name_color").toString();
+        msg.login = qsqPage.value("message_author_login").toString();
+        msg.room = room;
+        messages->append(msg);
+    }
+
+    qsqPage.finish();
+    return messages;
+}
+
+QList<AirinMessage> *AirinDatabase::getRecentMessages(int amount, QString room)
+{
+    CHECK_DB(NULL);
+
+    QList<AirinMessage> *messages = queryRecentMessages("messages", amount, room);
+
+    // A short room tail may go on in the archive, or the buffer would think it has it all
+    if (archivedMessageId.load() > 0 && messages != NULL && messages->count() < amount)
+        messages = prependMessages(messages, queryRecentMessages(AIRIN_ARCHIVE_TABLE,
+                                                                 amount - messages->count(), room));
+    return messages;
+}
+
+QList<AirinMessage> *AirinDatabase::queryRecentMessages(QString table, int amount, QString room)
+{
+    // This one seeds AirinHistory, so it takes everything and leaves filtering to it
+    QSqlQuery qsqGetRecent = prepared("SELECT * FROM (SELECT message_id, message_visible, message_author_name, "
+                                      "message_name_color, message_author_login, message_text, "
+                                      + timestampColumn() + " as timestamp "
+                                      "FROM " + table + " where message_room = ? "
+                                      "order by message_id desc LIMIT ?) AS recent order by message_id asc");
+    qsqGetRecent.addBindValue(room);
+    qsqGetRecent.addBindValue(amount);
+
+    if (!qsqGetRecent.exec())
+    {
+        log ("Could not execute this: "+qsqGetRecent.lastQuery(), LL_DEBUG);
+        log ("Recent messages SQL error: "+qsqGetRecent.lastError().text(), LL_WARNING);
+        return NULL;
+    }
+
+    QList<AirinMessage> *messages = new QList<AirinMessage>();
+    while (qsqGetRecent.next())
+    {
+        AirinMessage msg;
+        msg.id = qsqGetRecent.value("message_id").toInt();
+        msg.visible = qsqGetRecent.value("message_visible").toBool();
+        msg.message = qsqGetRecent.value("message_text").toString();
+        msg.name = qsqGetRecent.value("message_author_name").toString();
+        msg.timestamp = QDateTime::fromTime_t(qsqGetRecent.value("timestamp").toInt());
+        msg.color = qsqGetRecent.value("message_name_color").toString();
+        msg.login = qsqGetRecent.value("message_author_login").toString();
+        msg.room = room;
+        messages->append(msg);
+    }
+
+    qsqGetRecent.finish();
+    return messages;
 }
 
 uint AirinDatabase::lastMessage()
 {
-    return lastMessageId;
+    return lastMessageId.load();
+}
+
+int AirinDatabase::reserveMessageId()
+{
+    CHECK_DB(-1);
+
+    return lastMessageId.fetchAndAddOrdered(1) + 1;
+}
+
+static void raiseAtomic(QAtomicInt &value, int id)
+{
+    int current;
+
+    do
+    {
+        current = value.load();
+
+        if (id <= current)
+            return;
+    }
+    while (!value.testAndSetOrdered(current, id));
+}
+
+void AirinDatabase::raiseLastMessageId(int id)
+{
+    // Shared by all connections, and a reconnect must never move it back
+    // over the IDs already reserved for write-behind messages
+    raiseAtomic(lastMessageId, id);
+}
+
+QString AirinDatabase::messageTable(int id)
+{
+    return (id > 0 && id <= archivedMessageId.load()) ? AIRIN_ARCHIVE_TABLE : "messages";
+}
+
+int AirinDatabase::archiveMessages(uint olderThanDays, int batchSize)
+{
+    CHECK_DB(-1);
+
+    QString cutoff;
+    switch (dbType)
+    {
+        case DatabasePostgresql :
+            cutoff = QString("now() - interval '%1 days'").arg(olderThanDays);
+            break;
+
+        case DatabaseSqlite :
+            cutoff = QString("datetime('now', '-%1 days')").arg(olderThanDays);
+            break;
+
+        default :
+            cutoff = QString("NOW() - INTERVAL %1 DAY").arg(olderThanDays);
+            break;
+    }
+
+    // IDs grow with time, so only the oldest batch by primary key is looked at,
+    // no index on message_timestamp is needed. The newest message always stays:
+    // some servers take the next ID from the hot table after a restart.
+    QSqlQuery qsqBoundary(database);
+    qsqBoundary.prepare("SELECT MAX(message_id) AS boundary FROM "
+                        "(SELECT message_id, message_timestamp FROM messages ORDER BY message_id LIMIT ?) AS oldest "
+                        "WHERE message_timestamp < " + cutoff + " "
+                        "AND message_id < (SELECT MAX(message_id) FROM messages)");
+    qsqBoundary.addBindValue(batchSize);
+
+    if (!qsqBoundary.exec() || !qsqBoundary.next())
+    {
+        log ("Could not find messages to archive: "+qsqBoundary.lastError().text(), LL_WARNING);
+        return -1;
+    }
+
+    int boundary = qsqBoundary.value("boundary").toInt();
+    if (boundary <= 0)
+        return 0;
+
+    QString columns = "message_id, message_author_login, message_author_name, message_text, "
+                      "message_visible, message_timestamp, message_name_color, message_room";
+
+    database.transaction();
+
+    QSqlQuery qsqCopy(database);
+    qsqCopy.prepare("INSERT INTO " AIRIN_ARCHIVE_TABLE " (" + columns + ") "
+                    "SELECT " + columns + " FROM messages WHERE message_id <= ?");
+    qsqCopy.addBindValue(boundary);
+
+    QSqlQuery qsqDelete(database);
+    qsqDelete.prepare("DELETE FROM messages WHERE message_id <= ?");
+    qsqDelete.addBindValue(boundary);
+
+    if (!qsqCopy.exec() || !qsqDelete.exec() || !database.commit())
+    {
+        log (QString("Could not archive messages up to %1: %2 %3").arg(boundary)
+             .arg(qsqCopy.lastError().text()).arg(qsqDelete.lastError().text()), LL_WARNING);
+        database.rollback();
+        return -1;
+    }
+
+    raiseAtomic(archivedMessageId, boundary);
+
+    return qsqDelete.numRowsAffected();
+}
+
+AirinAuthResult AirinDatabase::lookupAuth(QString internalToken, bool withMiscInfo)
+{
+    AirinAuthResult result;
+
+    CHECK_DB(result);
+
+    AirinBanState cachedBan;
+    if (authCache.session(internalToken, &result) && authCache.banState(result.userId, &cachedBan))
+    {
+        result.banState = cachedBan;
+        if (!withMiscInfo)
+            result.miscInfo.clear();
+
+        return result;
+    }
+
+    result = AirinAuthResult();
+
+    // One round-trip instead of getUserId() + getMiscInfo() + isUserBanned().
+    // misc_info is taken from the session itself, not from any session of the user.
+    QSqlQuery qsqAuth = prepared("SELECT auth.user_id, auth.active, auth.misc_info, bans.ban_state "
+                                 "FROM auth LEFT JOIN bans ON bans.ban_login = auth.user_id "
+                                 "WHERE auth.internal_token = ?");
+    qsqAuth.addBindValue(internalToken);
+
+    if (!qsqAuth.exec())
+    {
+        log ("Could not execute this: "+qsqAuth.lastQuery(), LL_DEBUG);
+        log ("WARNING! Could not look up auth session: "+qsqAuth.lastError().text(), LL_WARNING);
+        return result; // no user id, so the client won't pass
+    }
+
+    if (!qsqAuth.first())
+    {
+        qsqAuth.finish();
+        return result;
+    }
+
+    result.active = qsqAuth.value("active").toBool();
+    QString userId = qsqAuth.value("user_id").toString();
+    QString miscInfo = qsqAuth.value("misc_info").toString().trimmed();
+    QVariant banState = qsqAuth.value("ban_state");
+    qsqAuth.finish();
+
+    // Killed sessions look exactly like unknown tokens, as getUserId() does
+    if (!result.active)
+        return result;
+
+    result.userId = userId;
+    result.miscInfo = miscInfo;
+
+    // No row in bans means NULL here
+    if (!banState.isNull())
+        result.banState = toBanState(banState.toInt());
+
+    authCache.storeSession(internalToken, result);
+    authCache.storeBanState(result.userId, result.banState);
+
+    if (!withMiscInfo)
+        result.miscInfo.clear();
+
+    return result;
 }
 
 QString AirinDatabase::getUserId(QString internalToken)
 {
     CHECK_DB(QString());
 
-    QSqlQuery qsqUidGet;
-    qsqUidGet.prepare("SELECT user_id, active FROM auth WHERE internal_token = ?");
+    AirinAuthResult cached;
+    if (authCache.session(internalToken, &cached))
+        return cached.userId;
+
+    QSqlQuery qsqUidGet = prepared("SELECT user_id, active FROM auth WHERE internal_token = ?");
     qsqUidGet.addBindValue(internalToken);
     if (!qsqUidGet.exec())
     {
@@ -353,16 +1149,13 @@ QString AirinDatabase::getUserId(QString internalToken)
     }
         else
     {
-        if (!qsqUidGet.first())
-            return QString();
-        else
-        {
-            if (!qsqUidGet.value("user_id").toString().isEmpty() &&
-                qsqUidGet.value("active").toBool())
-                return qsqUidGet.value("user_id").toString();
-            else
-                return QString();
-        }
+        QString userId;
+
+        if (qsqUidGet.first() && qsqUidGet.value("active").toBool())
+            userId = qsqUidGet.value("user_id").toString();
+
+        qsqUidGet.finish();
+        return userId;
     }
 }
 
@@ -370,8 +1163,7 @@ QString AirinDatabase::getMiscInfo(QString userLogin)
 {
     CHECK_DB(QString());
 
-    QSqlQuery qsqGetMisc;
-    qsqGetMisc.prepare("SELECT misc_info FROM auth WHERE user_id = ?");
+    QSqlQuery qsqGetMisc = prepared("SELECT misc_info FROM auth WHERE user_id = ?");
     qsqGetMisc.addBindValue(userLogin);
     if (!qsqGetMisc.exec())
     {
@@ -381,12 +1173,13 @@ QString AirinDatabase::getMiscInfo(QString userLogin)
     }
         else
     {
-        if (!qsqGetMisc.first())
-            return QString();
-        else
-        {
-            return qsqGetMisc.value("misc_info").toString().trimmed();
-        }
+        QString miscInfo;
+
+        if (qsqGetMisc.first())
+            miscInfo = qsqGetMisc.value("misc_info").toString().trimmed();
+
+        qsqGetMisc.finish();
+        return miscInfo;
     }
 }
 
@@ -394,8 +1187,7 @@ bool AirinDatabase::killAuthSession(QString internalToken)
 {
     CHECK_DB(false);
 
-    QSqlQuery qsqKillSession;
-    qsqKillSession.prepare("UPDATE auth SET active = false WHERE internal_token = ?");
+    QSqlQuery qsqKillSession = prepared("UPDATE auth SET active = false WHERE internal_token = ?");
     qsqKillSession.addBindValue(internalToken);
     if (!qsqKillSession.exec())
     {
@@ -404,27 +1196,39 @@ bool AirinDatabase::killAuthSession(QString internalToken)
         return false;
     }
     else
+    {
+        // Same as in setUserBanned(), dropped once the database says so
+        authCache.dropSession(internalToken);
         return true;
+    }
 }
 
 QString AirinDatabase::whois(int messageId)
 {
+    // Not found on the replica may just mean it's lagging behind
+    if (replicaReady())
+    {
+        QString login = replica->whois(messageId);
+        if (!login.isEmpty())
+            return login;
+    }
+
     CHECK_DB(QString());
 
-    QSqlQuery qsqWhois;
-    qsqWhois.prepare("SELECT message_author_login FROM messages WHERE message_id = ?");
+    QSqlQuery qsqWhois = prepared("SELECT message_author_login FROM " + messageTable(messageId) + " WHERE message_id = ?");
     qsqWhois.addBindValue(messageId);
 
     if (!qsqWhois.exec())
         return QString();
     else
     {
+        QString login;
+
         if (qsqWhois.next())
-        {
-           return qsqWhois.value("message_author_login").toString();
-        }
-        else
-           return QString();
+           login = qsqWhois.value("message_author_login").toString();
+
+        qsqWhois.finish();
+        return login;
     }
 }
 
@@ -432,8 +1236,7 @@ bool AirinDatabase::setMessageStatus(int id, bool isActive)
 {
     CHECK_DB(false);
 
-    QSqlQuery qsqSetMsgStatus;
-    qsqSetMsgStatus.prepare("UPDATE messages SET message_visible=? WHERE message_id=?");
+    QSqlQuery qsqSetMsgStatus = prepared("UPDATE " + messageTable(id) + " SET message_visible=? WHERE message_id=?");
     qsqSetMsgStatus.addBindValue(isActive);
     qsqSetMsgStatus.addBindValue(id);
 
@@ -443,13 +1246,19 @@ bool AirinDatabase::setMessageStatus(int id, bool isActive)
 
 AirinMessage AirinDatabase::messageInfo(int id)
 {
+    if (replicaReady())
+    {
+        AirinMessage msg = replica->messageInfo(id);
+        if (!msg.login.isEmpty())
+            return msg;
+    }
+
     CHECK_DB(AirinMessage());
 
-    QSqlQuery qsqGetMsg;
-    qsqGetMsg.prepare("SELECT message_id, message_visible, message_author_name, message_author_login, message_name_color, "
-                      "message_text, UNIX_TIMESTAMP(message_timestamp) as timestamp "
-                      "FROM messages "
-                      "where message_id = ?");
+    QSqlQuery qsqGetMsg = prepared("SELECT message_id, message_visible, message_author_name, message_author_login, message_name_color, "
+                                   "message_room, message_text, " + timestampColumn() + " as timestamp "
+                                   "FROM " + messageTable(id) + " "
+                                   "where message_id = ?");
 
     qsqGetMsg.addBindValue(id);
 
@@ -465,17 +1274,18 @@ AirinMessage AirinDatabase::messageInfo(int id)
 
         if (qsqGetMsg.next())
         {
-
             msg.id = qsqGetMsg.value("message_id").toInt();
             msg.visible = qsqGetMsg.value("message_visible").toBool();
             msg.message = qsqGetMsg.value("message_text").toString();
             msg.name = qsqGetMsg.value("message_author_name").toString();
             msg.login = qsqGetMsg.value("message_author_login").toString();
+            msg.room = qsqGetMsg.value("message_room").toString();
             msg.timestamp = QDateTime::fromTime_t(qsqGetMsg.value("timestamp").toInt());
             msg.color = qsqGetMsg.value("message_name_color").toString();
-            return msg;
         }
-            else return AirinMessage();
+
+        qsqGetMsg.finish();
+        return msg;
     }
 }
 
@@ -485,8 +1295,7 @@ bool AirinDatabase::setUserBanned(QString login, AirinBanState state, QString co
 
     QString query;
 
-    QSqlQuery qsqBanCheck;
-    qsqBanCheck.prepare("SELECT * FROM bans WHERE ban_login = ?");
+    QSqlQuery qsqBanCheck = prepared("SELECT * FROM bans WHERE ban_login = ?");
     qsqBanCheck.addBindValue(login);
     if (!qsqBanCheck.exec())
     {
@@ -500,28 +1309,50 @@ bool AirinDatabase::setUserBanned(QString login, AirinBanState state, QString co
             query = "UPDATE bans SET ban_state = ?, ban_comment = ? WHERE ban_login = ?";
         else
             query = "INSERT INTO bans (ban_state, ban_comment, ban_login) VALUES (?, ?, ?)";
+
+        qsqBanCheck.finish();
     }
 
     if (comment.isEmpty() || comment.isNull())
         comment = "Modified by Airin Admin tools";
 
-    QSqlQuery qsqBanUser;
-    qsqBanUser.prepare(query);
+    QSqlQuery qsqBanUser = prepared(query);
     qsqBanUser.addBindValue(state);
     qsqBanUser.addBindValue(comment);
     qsqBanUser.addBindValue(login);
 
-    return qsqBanUser.exec();
+    if (!qsqBanUser.exec())
+        return false;
+
+    // Only after the write, or a lookup on another connection could cache the old state again
+    authCache.dropUser(login);
+    return true;
 }
 
 QStringList AirinDatabase::userNames(QString login)
 {
+    if (replicaReady())
+    {
+        QStringList names = replica->userNames(login);
+        if (!names.isEmpty())
+            return names;
+    }
+
     CHECK_DB(QStringList());
 
-    QSqlQuery qsqUserNames;
-    qsqUserNames.prepare("SELECT DISTINCT message_author_name FROM messages WHERE message_author_login = ?");
+    QString query = "SELECT DISTINCT message_author_name FROM messages WHERE message_author_login = ?";
+
+    // Names used only in archived messages count too
+    bool withArchive = database.tables().contains(AIRIN_ARCHIVE_TABLE);
+    if (withArchive)
+        query += " UNION SELECT DISTINCT message_author_name FROM " AIRIN_ARCHIVE_TABLE " WHERE message_author_login = ?";
+
+    QSqlQuery qsqUserNames = prepared(query);
     qsqUserNames.addBindValue(login);
 
+    if (withArchive)
+        qsqUserNames.addBindValue(login);
+
     if (!qsqUserNames.exec())
         return QStringList();
     else
@@ -532,17 +1363,52 @@ QStringList AirinDatabase::userNames(QString login)
             names.append(qsqUserNames.value("message_author_name").toString());
         }
 
+        qsqUserNames.finish();
         return names;
     }
 }
 
+QStringList AirinDatabase::hiddenAuthors(bool *ok)
+{
+    *ok = false;
+    CHECK_DB(QStringList());
+
+    QString query = "SELECT DISTINCT message_author_login FROM messages WHERE message_visible = false";
+
+    // Databases that were never migrated have no archive yet
+    if (database.tables().contains(AIRIN_ARCHIVE_TABLE))
+        query += " UNION SELECT DISTINCT message_author_login FROM " AIRIN_ARCHIVE_TABLE " WHERE message_visible = false";
+
+    QSqlQuery qsqHidden(database);
+    if (!qsqHidden.exec(query))
+    {
+        log ("WARNING! Could not get authors of hidden messages: "+qsqHidden.lastError().text(), LL_WARNING);
+        return QStringList();
+    }
+
+    QStringList logins;
+    while (qsqHidden.next())
+        logins.append(qsqHidden.value("message_author_login").toString());
+
+    *ok = true;
+    return logins;
+}
+
 QList<AirinBanEntry> AirinDatabase::getBans()
 {
     QList<AirinBanEntry> bans;
 
+    // An empty list from a lagging or broken replica would unban everyone
+    if (replicaReady())
+    {
+        bans = replica->getBans();
+        if (!bans.isEmpty())
+            return bans;
+    }
+
     CHECK_DB(bans);
 
-    QSqlQuery qsqGetBans;
+    QSqlQuery qsqGetBans(database);
     if (!qsqGetBans.exec("SELECT ban_login, ban_comment, ban_state_tag, ban_state_description, ban_state as ban_state_id FROM bans INNER JOIN ban_states ON bans.ban_state = ban_states.ban_state_id WHERE ban_state_id <> 0"))
     {
         log ("WARNING! Could not get bans: "+qsqGetBans.lastError().text(), LL_WARNING);
@@ -566,6 +1432,55 @@ QList<AirinBanEntry> AirinDatabase::getBans()
     return bans;
 }
 
+QSqlQuery AirinDatabase::prepared(const QString &sql)
+{
+    // QSqlQuery is implicitly shared, so the copy is the same prepared statement.
+    // Callers finish() it after reading, this is just in case one forgot to.
+    if (statements.contains(sql))
+    {
+        cacheHits.fetchAndAddRelaxed(1);
+
+        QSqlQuery query = statements.value(sql);
+        query.finish();
+        return query;
+    }
+
+    cacheMisses.fetchAndAddRelaxed(1);
+
+    QSqlQuery query(database);
+    if (query.prepare(sql))
+        statements.insert(sql, query);
+    else
+        log ("Could not prepare a statement: "+query.lastError().text(), LL_WARNING);
+
+    return query;
+}
+
+void AirinDatabase::setAuthCacheLimits(uint ttlSeconds, uint maxEntries)
+{
+    authCache.setLimits(ttlSeconds, maxEntries);
+}
+
+quint64 AirinDatabase::authCacheHits()
+{
+    return authCache.hits();
+}
+
+quint64 AirinDatabase::authCacheMisses()
+{
+    return authCache.misses();
+}
+
+quint64 AirinDatabase::statementCacheHits()
+{
+    return cacheHits.load();
+}
+
+quint64 AirinDatabase::statementCacheMisses()
+{
+    return cacheMisses.load();
+}
+
 void AirinDatabase::log(QString message, LogLevel level)
 {
     AirinLogger::instance->log(message, level, "dbase");
@@ -576,7 +1491,7 @@ void AirinDatabase::pingSqlServer()
     // MySQL server tends to close connection if Airin doesn't
     // touch it for ~8h by default. OK, if Airin is alone,
     // she will talk to MySQL server because of boredom...
-    QSqlQuery qsqPing;
+    QSqlQuery qsqPing(database);
     if (qsqPing.exec("SELECT 1"))
     {
         log ("Successfully touched the SQL server.");
@@ -14,12 +14,26 @@
 #include <QSqlDatabase>
 #include <QSqlQuery>
 #include <QSqlError>
+#include <QSqlRecord>
 #include <QVariant>
 #include <QTimer>
 #include <QMap>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QHash>
 
 #include "airindata.h"
 #include "airinlogger.h"
+#include "airinauthcache.h"
+
+// Bump it together with a new entry in the migrations list (airindatabase.cpp)
+#define AIRIN_SCHEMA_VERSION 4
+
+// Old messages are moved here by archiveMessages(), everything up to archivedMessageId is there
+#define AIRIN_ARCHIVE_TABLE "messages_archive"
+
+// Every SQLite connection waits for the writer instead of failing at once
+#define AIRIN_SQLITE_OPTIONS "QSQLITE_BUSY_TIMEOUT=5000"
 
 
 
@@ -28,31 +42,57 @@ class AirinDatabase : public QObject
 {
     Q_OBJECT
 public:
-    explicit AirinDatabase(QObject *parent = 0);
+    // Every thread that talks to SQL needs its own instance and connection name
+    explicit AirinDatabase(QString connectionName = QLatin1String(QSqlDatabase::defaultConnection),
+                           QObject *parent = 0);
 
     ~AirinDatabase();
     static AirinDatabase *db;
 
     enum DatabaseType {
         DatabaseMysql,
-        DatabasePostgresql
+        DatabasePostgresql,
+        DatabaseSqlite
     };
 
+    static QString driverName(DatabaseType dbt);
+    static DatabaseType typeByName(QString name, bool *ok = NULL); // 'dbms' config value
+
     void setDatabaseType(DatabaseType dbt);
     bool start(QString host, QString database, QString username, QString password);
     void setDatabaseActive (bool active);
 
     void setPing(uint minutes);
 
+    // History and admin lookups go to the replica while it's alive, see replicaReady()
+    void setReplica(QString host, QString database, QString username, QString password, uint retryTimeout);
+    bool hasReplica();
+    bool replicaReady();
+
+    // Brings the schema up to AIRIN_SCHEMA_VERSION, or only reports what's missing.
+    // False if the schema is still older than that, queries won't work with it.
+    bool migrate(bool apply);
+
     QMap<QString, QVariant> getServerConfig();
     bool saveConfigValue (QString key, QString value);
 
     AirinBanState isUserBanned (QString userLogin);
+    AirinAuthResult lookupAuth (QString internalToken, bool withMiscInfo);
     bool isUserAdmin (QString userLogin);
 
-    int addMessage(QString authorLogin, QString text, QString name = QString(), QString color = QString(), bool isVisible = true);
-    QList<AirinMessage>* getMessages(int amount, int from = 0, QString userLogin = QString());
+    int addMessage(QString authorLogin, QString text, QString name = QString(), QString color = QString(),
+                   bool isVisible = true, QString room = AIRIN_DEFAULT_ROOM);
+    QList<AirinMessage>* getMessages(int amount, int from = 0, QString userLogin = QString(),
+                                     QString room = AIRIN_DEFAULT_ROOM);
+    // Keyset page: up to 'limit' visible messages right before or after 'cursorId', oldest first
+    QList<AirinMessage>* getMessagesPage(int limit, int cursorId, LogCursor direction,
+                                         QString userLogin, QString room = AIRIN_DEFAULT_ROOM);
+    QList<AirinMessage>* getRecentMessages(int amount, QString room = AIRIN_DEFAULT_ROOM); // hidden ones too
     uint lastMessage();
+    int reserveMessageId(); // for messages saved later by AirinMessageWriter
+
+    // Moves one batch of messages older than that to the archive table, returns how many
+    int archiveMessages(uint olderThanDays, int batchSize);
     QString getUserId(QString internalToken);
     QString getMiscInfo (QString userLogin);
     bool killAuthSession(QString internalToken);
@@ -64,21 +104,71 @@ public:
     AirinMessage messageInfo (int id);
     bool setUserBanned (QString login, AirinBanState state, QString comment = QString());
     QStringList userNames(QString login);
+    QStringList hiddenAuthors(bool *ok); // logins of those who have removed or shadowbanned messages
     QList<AirinBanEntry> getBans();
 
+    // Prepared statement cache counters, summed over all connections
+    static quint64 statementCacheHits();
+    static quint64 statementCacheMisses();
+
+    static void setAuthCacheLimits(uint ttlSeconds, uint maxEntries);
+    static quint64 authCacheHits();
+    static quint64 authCacheMisses();
+
+    static void raiseLastMessageId(int id); // for IDs that come from elsewhere, see AirinPgPipeline
+
 
 private:
     QSqlDatabase database;
-    uint lastMessageId;
+    QString connectionName;
+    static QAtomicInt lastMessageId; // the same for all connections
+    static QAtomicInt archivedMessageId;
+
+    // Reads that may hit the archive, see AIRIN_ARCHIVE_TABLE
+    QString messageTable(int id);
+    QList<AirinMessage> *queryMessages(QString table, int amount, int from, QString userLogin, QString room);
+    QList<AirinMessage> *queryRecentMessages(QString table, int amount, QString room);
+    QList<AirinMessage> *queryPage(QString table, int limit, int cursorId, LogCursor direction,
+                                   QString userLogin, QString room);
+
+    AirinBanState toBanState(int value);
+    QString timestampColumn();
+    void setupSqlite();
+
+    // Statements are prepared once per connection and re-bound on every call
+    QHash<QString, QSqlQuery> statements;
+    static QAtomicInteger<quint64> cacheHits;
+    static QAtomicInteger<quint64> cacheMisses;
+
+    QSqlQuery prepared(const QString &sql);
+
+    static AirinAuthCache authCache; // shared by all connections
+
+    // Migrations, see the list in airindatabase.cpp
+    int schemaVersion();
+    bool setSchemaVersion(int version);
+    bool indexExists(const QString &name);
+    bool verifyIndexes();
+    bool migrateRooms();
+    bool migrateIndexes();
+    bool migrateArchive();
+    bool migrateHiddenIndex();
     QTimer *pingTimer;
     bool databaseActive;
 
+    AirinDatabase *replica; // same type, lives in the same thread
+    QString replicaHost, replicaName, replicaUser, replicaPassword;
+    uint replicaRetryTimeout;
+    bool replicaRetrying;
+
     DatabaseType dbType;
 
     void log (QString message, LogLevel level = LL_DEBUG);
 
 private slots:
     void pingSqlServer();
+    void startReplica();
+    void replicaFailed();
 
 signals:
     void databaseFailed();
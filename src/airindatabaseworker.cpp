@@ -0,0 +1,187 @@
+#include "airindatabaseworker.h"
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+AirinDatabaseWorker::AirinDatabaseWorker(int number, QObject *parent) : QObject(parent)
+{
+    qRegisterMetaType<AirinAuthResult>("AirinAuthResult");
+    qRegisterMetaType<AirinLogRequest>("AirinLogRequest");
+    qRegisterMetaType<AirinMessageList>("AirinMessageList");
+
+    connectionName = QString("airin_worker_%1").arg(number);
+    dbThread = new QThread();
+    db = NULL;
+    dbType = AirinDatabase::DatabaseMysql;
+    replicaRetryTimeout = 0;
+    retryTimeout = 1000;
+    retryDelay = retryTimeout;
+    retryPending = false;
+}
+
+AirinDatabaseWorker::~AirinDatabaseWorker()
+{
+    stop();
+    delete dbThread;
+}
+
+void AirinDatabaseWorker::setDatabase(AirinDatabase::DatabaseType type, QString host, QString database,
+                                      QString username, QString password)
+{
+    dbType = type;
+    dbHost = host;
+    dbName = database;
+    dbUser = username;
+    dbPassword = password;
+}
+
+void AirinDatabaseWorker::setReplica(QString host, QString database, QString username, QString password,
+                                     uint retryTimeout)
+{
+    replicaHost = host;
+    replicaName = database;
+    replicaUser = username;
+    replicaPassword = password;
+    replicaRetryTimeout = retryTimeout;
+}
+
+void AirinDatabaseWorker::setRetryTimeout(uint timeout)
+{
+    retryTimeout = qMax((uint)1, timeout);
+    retryDelay = retryTimeout;
+}
+
+void AirinDatabaseWorker::start()
+{
+    moveToThread(dbThread);
+    dbThread->start();
+
+    QMetaObject::invokeMethod(this, "openDatabase", Qt::QueuedConnection);
+}
+
+void AirinDatabaseWorker::stop()
+{
+    if (!dbThread->isRunning())
+        return;
+
+    QMetaObject::invokeMethod(this, "closeDatabase", Qt::BlockingQueuedConnection);
+
+    dbThread->quit();
+    dbThread->wait();
+}
+
+void AirinDatabaseWorker::openDatabase()
+{
+    db = new AirinDatabase(connectionName, this);
+    db->setDatabaseType(dbType);
+    connect (db, SIGNAL(databaseFailed()), this, SLOT(reconnect()));
+
+    connectDatabase();
+
+    if (!replicaHost.isEmpty())
+        db->setReplica(replicaHost, replicaName, replicaUser, replicaPassword, replicaRetryTimeout);
+}
+
+void AirinDatabaseWorker::closeDatabase()
+{
+    delete db;
+    db = NULL;
+
+    QSqlDatabase::removeDatabase(connectionName);
+
+    if (QSqlDatabase::contains(connectionName + "_replica"))
+        QSqlDatabase::removeDatabase(connectionName + "_replica");
+}
+
+void AirinDatabaseWorker::reconnect()
+{
+    retryPending = false;
+
+    // The request that found the connection dead gets an error,
+    // the next one will use the new connection if it's up by then
+    if (db != NULL)
+        connectDatabase();
+}
+
+void AirinDatabaseWorker::connectDatabase()
+{
+    if (db->start(dbHost, dbName, dbUser, dbPassword))
+    {
+        retryDelay = retryTimeout;
+        return;
+    }
+
+    // CHECK_DB stays quiet while the connection is down, so nobody else will ask for it
+    if (!retryPending)
+    {
+        retryPending = true;
+        QTimer::singleShot(retryDelay, this, SLOT(reconnect()));
+        retryDelay = qMin(retryDelay * 2, (uint)AIRIN_DB_WORKER_MAX_RETRY);
+    }
+}
+
+void AirinDatabaseWorker::lookupAuth(quint64 clientHandle, QString internalToken, bool withMiscInfo)
+{
+    AirinAuthResult result;
+
+    if (db != NULL)
+        result = db->lookupAuth(internalToken, withMiscInfo);
+
+    emit authLookedUp(clientHandle, result);
+}
+
+void AirinDatabaseWorker::fetchLog(AirinLogRequest req, QString login)
+{
+    QList<AirinMessage> *messages = NULL;
+
+    if (db != NULL)
+    {
+        // Pages ask for one more row to know if there's anything left
+        if (req.cursor == LogWindow)
+            messages = db->getMessages(req.amount, req.from, login, req.room);
+        else
+            messages = db->getMessagesPage(req.amount + 1, req.from, req.cursor, login, req.room);
+    }
+
+    if (messages == NULL)
+    {
+        emit logFetched(req, AirinMessageList(), false);
+        return;
+    }
+
+    emit logFetched(req, *messages, true);
+    delete messages;
+}
+
+void AirinDatabaseWorker::fetchRecent(QString room, int amount)
+{
+    QList<AirinMessage> *messages = (db != NULL) ? db->getRecentMessages(amount, room) : NULL;
+
+    if (messages == NULL)
+    {
+        emit recentFetched(room, amount, AirinMessageList(), false);
+        return;
+    }
+
+    emit recentFetched(room, amount, *messages, true);
+    delete messages;
+}
+
+void AirinDatabaseWorker::fetchHiddenAuthors()
+{
+    bool ok = false;
+    QStringList logins;
+
+    if (db != NULL)
+        logins = db->hiddenAuthors(&ok);
+
+    emit hiddenAuthorsFetched(logins, ok);
+}
+
+void AirinDatabaseWorker::archiveMessages(uint olderThanDays, int batchSize)
+{
+    emit messagesArchived((db != NULL) ? db->archiveMessages(olderThanDays, batchSize) : -1);
+}
@@ -0,0 +1,84 @@
+#ifndef AIRINDATABASEWORKER_H
+#define AIRINDATABASEWORKER_H
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QMetaType>
+
+#include "airindata.h"
+#include "airindatabase.h"
+
+// A worker that lost its connection tries again after the reconnect timeout,
+// doubling it on every failure up to this
+#define AIRIN_DB_WORKER_MAX_RETRY 60000
+
+typedef QList<AirinMessage> AirinMessageList;
+
+Q_DECLARE_METATYPE(AirinAuthResult)
+Q_DECLARE_METATYPE(AirinLogRequest)
+Q_DECLARE_METATYPE(AirinMessageList)
+
+// A database worker owns a thread and an SQL connection of its own.
+// Requests come as queued slot calls and results go back as signals,
+// so the main event loop keeps serving frames while a query runs.
+// A few workers make a connection pool, see AirinServer::setupDatabaseWorkers().
+class AirinDatabaseWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit AirinDatabaseWorker(int number, QObject *parent = 0);
+    ~AirinDatabaseWorker();
+
+    void setDatabase(AirinDatabase::DatabaseType type, QString host, QString database,
+                     QString username, QString password);
+    void setReplica(QString host, QString database, QString username, QString password, uint retryTimeout);
+    void setRetryTimeout(uint timeout); // ms
+
+    void start();
+    void stop();
+
+public slots:
+    void lookupAuth(quint64 clientHandle, QString internalToken, bool withMiscInfo);
+    void fetchLog(AirinLogRequest req, QString login);
+    void fetchRecent(QString room, int amount);
+    void fetchHiddenAuthors();
+    void archiveMessages(uint olderThanDays, int batchSize);
+
+private:
+    QThread *dbThread;
+    AirinDatabase *db; // created in dbThread
+
+    QString connectionName;
+    AirinDatabase::DatabaseType dbType;
+    QString dbHost, dbName, dbUser, dbPassword;
+    QString replicaHost, replicaName, replicaUser, replicaPassword; // empty host = no replica
+    uint replicaRetryTimeout;
+    uint retryTimeout, retryDelay;
+    bool retryPending;
+
+    void connectDatabase();
+
+private slots:
+    void openDatabase();
+    void closeDatabase();
+    void reconnect();
+
+signals:
+    void authLookedUp(quint64 clientHandle, AirinAuthResult result);
+    void logFetched(AirinLogRequest req, AirinMessageList messages, bool ok);
+    void recentFetched(QString room, int amount, AirinMessageList messages, bool ok);
+    void hiddenAuthorsFetched(QStringList logins, bool ok);
+    void messagesArchived(int count);
+};
+
+#endif // AIRINDATABASEWORKER_H
@@ -0,0 +1,126 @@
+#include "airinframe.h"
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+// In AirinFrame::Command order
+static const char *commandNames[AirinFrame::CmdCount] = {
+    "",
+    "IN",
+    "CONNECT",
+    "LEVEL",
+    "CONTENT",
+    "IAM",
+    "LOG",
+    "LOGOFF",
+    "DOWNGRADE",
+    "GETSET",
+    "SUS",
+    "COMPRESS",
+    "JOIN",
+    "PART",
+    "SYNC"
+};
+
+AirinFrame::AirinFrame(const QString &frame) : frame(frame)
+{
+    wordCount = 0;
+    payloadAt = -1;
+
+    const QChar *data = this->frame.constData();
+    int length = this->frame.length(), i = 0;
+
+    while (i < length)
+    {
+        if (data[i] == QLatin1Char('#'))
+        {
+            payloadAt = i + 1;
+            break;
+        }
+
+        if (data[i] == QLatin1Char(' '))
+        {
+            i++;
+            continue;
+        }
+
+        int start = i;
+        while (i < length && data[i] != QLatin1Char(' ') && data[i] != QLatin1Char('#'))
+            i++;
+
+        if (wordCount < AIRIN_FRAME_MAX_ARGS)
+            words[wordCount] = QStringRef(&this->frame, start, i - start);
+
+        wordCount++;
+    }
+
+    cmd = (wordCount > 0) ? lookup(name()) : CmdUnknown;
+}
+
+AirinFrame::Command AirinFrame::command() const
+{
+    return cmd;
+}
+
+QStringRef AirinFrame::name() const
+{
+    return (wordCount > 0) ? words[0].trimmed() : QStringRef();
+}
+
+int AirinFrame::argc() const
+{
+    return wordCount;
+}
+
+QStringRef AirinFrame::arg(int i) const
+{
+    if (i < 0 || i >= wordCount || i >= AIRIN_FRAME_MAX_ARGS)
+        return QStringRef();
+
+    return words[i];
+}
+
+bool AirinFrame::hasPayload() const
+{
+    return payloadAt > -1;
+}
+
+QStringRef AirinFrame::payload() const
+{
+    if (payloadAt < 0)
+        return QStringRef();
+
+    return frame.midRef(payloadAt);
+}
+
+QStringRef AirinFrame::from(int i) const
+{
+    if (i >= 0 && i < wordCount && i < AIRIN_FRAME_MAX_ARGS)
+        return frame.midRef(words[i].position());
+
+    // Only the payload is left
+    if (payloadAt > -1 && i == qMin(wordCount, AIRIN_FRAME_MAX_ARGS))
+        return frame.midRef(payloadAt - 1);
+
+    return QStringRef();
+}
+
+const char *AirinFrame::commandName(AirinFrame::Command command)
+{
+    return (command > CmdUnknown && command < CmdCount) ? commandNames[command] : "";
+}
+
+AirinFrame::Command AirinFrame::lookup(const QStringRef &name)
+{
+    // Lengths differ almost everywhere, so most of these are a single int compare
+    for (int i = CmdUnknown + 1; i < CmdCount; i++)
+    {
+        if (name == QLatin1String(commandNames[i]))
+            return (Command)i;
+    }
+
+    return CmdUnknown;
+}
@@ -0,0 +1,68 @@
+#ifndef AIRINFRAME_H
+#define AIRINFRAME_H
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QString>
+#include <QStringRef>
+#include <QLatin1String>
+
+// Arguments after this many are counted but not kept
+#define AIRIN_FRAME_MAX_ARGS 8
+
+// A client frame split into words, "CMD arg1 arg2 #payload".
+// Only the part before the first '#' is split, the payload (chat text,
+// app name etc) is never touched. Words are views into the frame itself,
+// so parsing allocates nothing. Don't copy it, the views point inside.
+class AirinFrame
+{
+public:
+    // Everything processClientCommand() knows, see AirinServer::commandTable
+    enum Command {
+        CmdUnknown,
+        CmdIn,
+        CmdConnect,
+        CmdLevel,
+        CmdContent,
+        CmdIam,
+        CmdLog,
+        CmdLogoff,
+        CmdDowngrade,
+        CmdGetset,
+        CmdSus,
+        CmdCompress,
+        CmdJoin,
+        CmdPart,
+        CmdSync,
+        CmdCount // not a command
+    };
+
+    explicit AirinFrame(const QString &frame);
+
+    Command command() const;
+    QStringRef name() const;      // the command word as it came
+    int argc() const;             // words before the payload, the command included
+    QStringRef arg(int i) const;  // null if there's no such word
+    bool hasPayload() const;
+    QStringRef payload() const;   // everything after the first '#'
+    QStringRef from(int i) const; // the frame starting at i-th word, payload included
+
+    static const char *commandName(Command command);
+
+private:
+    Q_DISABLE_COPY(AirinFrame)
+
+    QString frame; // implicitly shared with the caller's string
+    QStringRef words[AIRIN_FRAME_MAX_ARGS];
+    int wordCount;
+    int payloadAt; // -1 if there's no '#'
+    Command cmd;
+
+    static Command lookup(const QStringRef &name);
+};
+
+#endif // AIRINFRAME_H
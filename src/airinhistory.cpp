@@ -0,0 +1,299 @@
+#include "airinhistory.h"
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <algorithm>
+
+AirinHistory::AirinHistory()
+{
+    size = 0;
+    hitCount = 0;
+    missCount = 0;
+
+    changes.setCapacity(AIRIN_HISTORY_MAX_CHANGES);
+    changesFloor = -1;
+}
+
+void AirinHistory::setCapacity(int messages)
+{
+    if (messages == size)
+        return;
+
+    // Rooms will be seeded again with the new size on demand
+    size = (messages > 0) ? messages : 0;
+    rooms.clear();
+}
+
+int AirinHistory::capacity() const
+{
+    return size;
+}
+
+bool AirinHistory::isSeeded(const QString &room) const
+{
+    return rooms.contains(room) && rooms.value(room).seeded;
+}
+
+void AirinHistory::seed(const QString &room, const QList<AirinMessage> &messages)
+{
+    if (size <= 0)
+        return;
+
+    Room &r = rooms[room];
+    QContiguousCache<AirinMessage> merged(size);
+
+    for (int i = 0; i < messages.count(); i++)
+        merged.append(messages.at(i));
+
+    // Messages that came while the database was asked (or are not saved yet) go on top
+    int lastSeeded = messages.isEmpty() ? 0 : messages.last().id;
+    int appended = messages.count();
+
+    for (int i = r.messages.firstIndex(); !r.messages.isEmpty() && i <= r.messages.lastIndex(); i++)
+    {
+        if (r.messages.at(i).id > lastSeeded)
+        {
+            merged.append(r.messages.at(i));
+            appended++;
+        }
+    }
+
+    // The database may have been asked before a removal or restore went through
+    for (int i = changes.firstIndex(); !changes.isEmpty() && i <= changes.lastIndex(); i++)
+    {
+        int index = indexOf(merged, changes.at(i).id);
+
+        if (index != -1)
+            merged[index].visible = changes.at(i).visible;
+    }
+
+    r.messages = merged;
+    r.seeded = true;
+    r.complete = (messages.count() < size) && (appended <= size);
+}
+
+void AirinHistory::append(const AirinMessage &message)
+{
+    if (size <= 0 || message.id <= 0)
+        return;
+
+    Room &r = rooms[message.room];
+
+    if (r.messages.capacity() != size)
+        r.messages.setCapacity(size);
+
+    if (r.messages.isFull())
+        r.complete = false;
+
+    r.messages.append(message);
+
+    if (!r.messages.areIndexesValid())
+        r.messages.normalizeIndexes();
+}
+
+bool AirinHistory::setVisible(int id, bool visible)
+{
+    QHash<QString, Room>::iterator it;
+    for (it = rooms.begin(); it != rooms.end(); ++it)
+    {
+        int index = indexOf(it.value().messages, id);
+
+        if (index != -1)
+        {
+            it.value().messages[index].visible = visible;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void AirinHistory::forget(const QList<int> &ids)
+{
+    if (ids.isEmpty())
+        return;
+
+    QHash<QString, Room>::iterator it;
+    for (it = rooms.begin(); it != rooms.end(); ++it)
+    {
+        QContiguousCache<AirinMessage> &messages = it.value().messages;
+        QContiguousCache<AirinMessage> kept(messages.capacity());
+
+        for (int i = messages.firstIndex(); !messages.isEmpty() && i <= messages.lastIndex(); i++)
+        {
+            if (!std::binary_search(ids.constBegin(), ids.constEnd(), messages.at(i).id))
+                kept.append(messages.at(i));
+        }
+
+        // 'complete' stays as is, the buffer just lost some entries
+        messages = kept;
+    }
+
+    QContiguousCache<Change> keptChanges(changes.capacity());
+
+    for (int i = changes.firstIndex(); !changes.isEmpty() && i <= changes.lastIndex(); i++)
+    {
+        if (!std::binary_search(ids.constBegin(), ids.constEnd(), changes.at(i).id))
+            keptChanges.append(changes.at(i));
+    }
+
+    changes = keptChanges;
+}
+
+bool AirinHistory::fetch(QList<AirinMessage> *result, int amount, int from,
+                         const QString &login, const QString &room)
+{
+    if (size <= 0 || amount <= 0 || !rooms.contains(room))
+    {
+        missCount++;
+        return false;
+    }
+
+    const Room &r = rooms[room];
+    const QContiguousCache<AirinMessage> &messages = r.messages;
+
+    if (messages.isEmpty())
+    {
+        if (!r.complete)
+        {
+            missCount++;
+            return false;
+        }
+
+        hitCount++;
+        return true; // room exists but is empty
+    }
+
+    if (from > 0)
+    {
+        // Anything older than the buffer lives in SQL only
+        if (from < messages.first().id && !r.complete)
+        {
+            missCount++;
+            return false;
+        }
+
+        for (int i = messages.firstIndex(); i <= messages.lastIndex() && result->count() < amount; i++)
+        {
+            const AirinMessage &msg = messages.at(i);
+
+            if (msg.id >= from && (msg.visible || msg.login == login))
+                result->append(msg);
+        }
+    }
+    else
+    {
+        for (int i = messages.lastIndex(); i >= messages.firstIndex() && result->count() < amount; i--)
+        {
+            const AirinMessage &msg = messages.at(i);
+
+            if (msg.visible || msg.login == login)
+                result->prepend(msg);
+        }
+
+        // Too many hidden messages in the buffer, the rest is in SQL
+        if (result->count() < amount && !r.complete)
+        {
+            result->clear();
+            missCount++;
+            return false;
+        }
+    }
+
+    hitCount++;
+    return true;
+}
+
+void AirinHistory::startChangeLog(int watermark)
+{
+    // Whatever happened before the server started is unknown
+    if (changesFloor < 0)
+        changesFloor = watermark + 1;
+}
+
+void AirinHistory::logChange(const QString &room, int id, bool visible, int watermark)
+{
+    if (changesFloor < 0)
+        return;
+
+    if (changes.isFull())
+        changesFloor = qMax(changesFloor, changes.first().watermark + 1);
+
+    Change change;
+    change.room = room;
+    change.id = id;
+    change.visible = visible;
+    change.watermark = watermark;
+
+    changes.append(change);
+
+    if (!changes.areIndexesValid())
+        changes.normalizeIndexes();
+}
+
+bool AirinHistory::removedSince(QList<int> *removed, int since, const QString &room) const
+{
+    // A change with a watermark equal to 'since' might have come right after the client left,
+    // so the floor is always one above the forgotten ones
+    if (changesFloor < 0 || since < changesFloor)
+        return false;
+
+    QHash<int, bool> latest;
+
+    for (int i = changes.firstIndex(); !changes.isEmpty() && i <= changes.lastIndex(); i++)
+    {
+        const Change &change = changes.at(i);
+
+        if (change.watermark >= since && change.room == room)
+            latest.insert(change.id, change.visible);
+    }
+
+    QHash<int, bool>::const_iterator it;
+    for (it = latest.constBegin(); it != latest.constEnd(); ++it)
+    {
+        if (!it.value())
+            removed->append(it.key());
+    }
+
+    std::sort(removed->begin(), removed->end());
+    return true;
+}
+
+quint64 AirinHistory::hits() const
+{
+    return hitCount;
+}
+
+quint64 AirinHistory::misses() const
+{
+    return missCount;
+}
+
+int AirinHistory::indexOf(const QContiguousCache<AirinMessage> &messages, int id)
+{
+    if (messages.isEmpty())
+        return -1;
+
+    // IDs only grow, so the buffer is always sorted
+    int low = messages.firstIndex(), high = messages.lastIndex();
+
+    while (low <= high)
+    {
+        int middle = low + (high - low) / 2;
+        int middleId = messages.at(middle).id;
+
+        if (middleId == id)
+            return middle;
+
+        if (middleId < id)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+
+    return -1;
+}
@@ -0,0 +1,85 @@
+#ifndef AIRINHISTORY_H
+#define AIRINHISTORY_H
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QContiguousCache>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+#include "airindata.h"
+
+// Removals and restores remembered for SYNC, for all the rooms together
+#define AIRIN_HISTORY_MAX_CHANGES 1024
+
+// Last N messages of every room kept in memory, so the usual "give me
+// the last 20" LOG request does not touch the database at all.
+// Hidden (removed or shadowbanned) messages are kept too because their
+// authors still see them, exactly as the SQL query in getMessages() does.
+class AirinHistory
+{
+public:
+    AirinHistory();
+
+    void setCapacity(int messages); // per room, 0 disables the buffer
+    int capacity() const;
+
+    bool isSeeded(const QString &room) const;
+    void seed(const QString &room, const QList<AirinMessage> &messages);
+
+    void append(const AirinMessage &message);
+    bool setVisible(int id, bool visible);
+    void forget(const QList<int> &ids); // sorted, messages that never got saved
+
+    // Returns false if the buffer can't answer and SQL should be asked instead
+    bool fetch(QList<AirinMessage> *result, int amount, int from,
+               const QString &login, const QString &room);
+
+    // Removals and restores, so SYNC can tell a reconnecting client what it missed.
+    // 'watermark' is the newest message ID at the moment of the change.
+    void startChangeLog(int watermark);
+    void logChange(const QString &room, int id, bool visible, int watermark);
+
+    // IDs of messages removed since 'since' was the newest one the client saw.
+    // Returns false if some of those changes are forgotten already.
+    bool removedSince(QList<int> *removed, int since, const QString &room) const;
+
+    quint64 hits() const;
+    quint64 misses() const;
+
+private:
+    struct Room
+    {
+        Room() : seeded(false), complete(false) {}
+
+        QContiguousCache<AirinMessage> messages;
+        bool seeded;   // filled from the database once
+        bool complete; // holds the whole room history, nothing older exists
+    };
+
+    struct Change
+    {
+        QString room;
+        int id;
+        bool visible;
+        int watermark;
+    };
+
+    QHash<QString, Room> rooms;
+    int size;
+
+    QContiguousCache<Change> changes;
+    int changesFloor; // changes made before this watermark may be gone, -1 until started
+
+    quint64 hitCount;
+    quint64 missCount;
+
+    static int indexOf(const QContiguousCache<AirinMessage> &messages, int id);
+};
+
+#endif // AIRINHISTORY_H
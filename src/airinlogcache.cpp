@@ -0,0 +1,99 @@
+#include "airinlogcache.h"
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+AirinLogCache::AirinLogCache()
+{
+    size = 0;
+    currentGeneration = 0;
+    hitCount = 0;
+    missCount = 0;
+}
+
+void AirinLogCache::setCapacity(int entries)
+{
+    size = (entries > 0) ? entries : 0;
+
+    // Every entry costs 1, so that's the number of answers kept
+    this->entries.setMaxCost(size);
+}
+
+int AirinLogCache::capacity() const
+{
+    return size;
+}
+
+const AirinLogCacheEntry *AirinLogCache::find(const AirinLogRequest &req)
+{
+    if (size <= 0)
+        return NULL;
+
+    AirinLogCacheEntry *entry = entries.object(key(req));
+
+    if (entry != NULL)
+        hitCount++;
+    else
+        missCount++;
+
+    return entry;
+}
+
+const AirinLogCacheEntry *AirinLogCache::insert(const AirinLogRequest &req, const AirinLogCacheEntry &entry)
+{
+    if (size <= 0)
+        return NULL;
+
+    QString k = key(req);
+    AirinLogCacheEntry *stored = new AirinLogCacheEntry(entry);
+
+    // QCache owns it from now on
+    if (!entries.insert(k, stored, 1))
+        return NULL;
+
+    return entries.object(k);
+}
+
+void AirinLogCache::invalidate(const QString &room)
+{
+    currentGeneration++;
+
+    QString prefix = room + " ";
+    QList<QString> keys = entries.keys();
+
+    for (int i = 0; i < keys.count(); i++)
+    {
+        if (keys.at(i).startsWith(prefix))
+            entries.remove(keys.at(i));
+    }
+}
+
+void AirinLogCache::clear()
+{
+    currentGeneration++;
+    entries.clear();
+}
+
+quint64 AirinLogCache::generation() const
+{
+    return currentGeneration;
+}
+
+quint64 AirinLogCache::hits() const
+{
+    return hitCount;
+}
+
+quint64 AirinLogCache::misses() const
+{
+    return missCount;
+}
+
+QString AirinLogCache::key(const AirinLogRequest &req)
+{
+    // Room names have no spaces, see processRoomChange()
+    return QString("%1 %2 %3 %4").arg(req.room).arg(req.amount).arg(req.from).arg(req.order);
+}
@@ -0,0 +1,57 @@
+#ifndef AIRINLOGCACHE_H
+#define AIRINLOGCACHE_H
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QCache>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+#include "airindata.h"
+
+// A LOG answer as everyone without hidden messages of their own sees it
+struct AirinLogCacheEntry {
+    QList<AirinMessage> messages;
+    QStringList frames; // encoded LOGCON lines, in sending order
+};
+
+// Answers of classic LOG <amount> [from] [ASC|DESC] requests, shared by every
+// client that asks the same. Anything that changes what a room looks like
+// (new, removed or restored message) throws the room's answers away, and
+// bumps the generation, so an answer that was being prepared meanwhile
+// (e.g. by a database worker) is not stored.
+class AirinLogCache
+{
+public:
+    AirinLogCache();
+
+    void setCapacity(int entries); // 0 disables the cache
+    int capacity() const;
+
+    const AirinLogCacheEntry *find(const AirinLogRequest &req);
+    const AirinLogCacheEntry *insert(const AirinLogRequest &req, const AirinLogCacheEntry &entry);
+
+    void invalidate(const QString &room);
+    void clear();
+    quint64 generation() const;
+
+    quint64 hits() const;
+    quint64 misses() const;
+
+private:
+    QCache<QString, AirinLogCacheEntry> entries;
+    int size;
+    quint64 currentGeneration;
+
+    quint64 hitCount;
+    quint64 missCount;
+
+    static QString key(const AirinLogRequest &req);
+};
+
+#endif // AIRINLOGCACHE_H
@@ -25,6 +25,8 @@ void AirinLogger::log(QString message, LogLevel logLevel, QString component)
         case LL_NONE    : return;
     }
 
+   QMutexLocker locker(&writeLock);
+
    if (writeStdout)
         printf ("[%s] <%s> %s: %s\n",
                 QDateTime::currentDateTime().toString("dd.MM.yy@hh:mm:ss:zzz").toUtf8().data(),
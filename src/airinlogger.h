@@ -12,6 +12,7 @@
 #include <QString>
 #include <QTextStream>
 #include <QDateTime>
+#include <QMutex>
 #include <cstdio>
 
 #include "airindata.h"
@@ -81,6 +82,7 @@ private:
     LogLevel adminVerbosity;
 
     AirinClient *admin;
+    QMutex writeLock; // database workers log from their own threads
 
 private slots:
     void adminDisconnected();
@@ -0,0 +1,165 @@
+#include "airinlogscheduler.h"
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+AirinLogScheduler::AirinLogScheduler()
+{
+    nextRequestId = 1;
+    maxRequests = 50;
+    maxPerAddress = 10;
+}
+
+void AirinLogScheduler::setLimits(int maxRequests, int maxPerAddress)
+{
+    this->maxRequests = maxRequests;
+    this->maxPerAddress = maxPerAddress;
+}
+
+AirinLogScheduler::Result AirinLogScheduler::enqueue(const AirinLogRequest &req, const QString &login,
+                                                     const QString &address)
+{
+    // Hidden messages of the user are a part of the answer, so the user is a part of the key
+    QString key = QString("%1 %2 %3 %4 %5 %6").arg(req.room).arg(req.amount).arg(req.from)
+                                              .arg(req.order).arg(req.cursor).arg(login);
+
+    if (requestsByKey.contains(key))
+    {
+        Pending &pending = requests[requestsByKey.value(key)];
+
+        // The same client asking again gets a single answer
+        if (pending.req.clientHandle != req.clientHandle && !pending.req.followers.contains(req.clientHandle))
+        {
+            pending.req.followers.append(req.clientHandle);
+            pending.followerAddresses.append(address);
+        }
+
+        return Merged;
+    }
+
+    if (requests.count() >= maxRequests)
+        return QueueFull;
+
+    if (addressQueues.contains(address) && addressQueues.value(address).pending >= maxPerAddress)
+        return AddressFull;
+
+    quint64 id = nextRequestId++;
+
+    Pending entry;
+    entry.req = req;
+    entry.req.followers.clear();
+    entry.key = key;
+
+    requests.insert(id, entry);
+    requestsByKey.insert(key, id);
+
+    schedule(id, req.clientHandle, address);
+    return Queued;
+}
+
+bool AirinLogScheduler::next(AirinLogRequest *req)
+{
+    while (!addressOrder.isEmpty())
+    {
+        QString address = addressOrder.dequeue();
+        AddressQueue &queue = addressQueues[address];
+
+        quint64 handle = 0;
+        while (!queue.clients.isEmpty() && handle == 0)
+        {
+            handle = queue.clients.dequeue();
+
+            if (!clientQueues.contains(handle)) // removed meanwhile
+                handle = 0;
+        }
+
+        if (handle == 0)
+        {
+            addressQueues.remove(address);
+            continue;
+        }
+
+        ClientQueue &client = clientQueues[handle];
+        quint64 id = client.requests.dequeue();
+
+        if (client.requests.isEmpty())
+            clientQueues.remove(handle);
+        else
+            queue.clients.enqueue(handle);
+
+        queue.pending--;
+
+        if (queue.clients.isEmpty())
+            addressQueues.remove(address);
+        else
+            addressOrder.enqueue(address);
+
+        Pending entry = requests.take(id);
+        requestsByKey.remove(entry.key);
+
+        *req = entry.req;
+        return true;
+    }
+
+    return false;
+}
+
+void AirinLogScheduler::remove(quint64 clientHandle)
+{
+    // Followers are not looked for, the server skips gone ones when it answers
+    if (!clientQueues.contains(clientHandle))
+        return;
+
+    // The handle itself stays in its address queue until its turn, next() skips it
+    ClientQueue client = clientQueues.take(clientHandle);
+
+    if (addressQueues.contains(client.address))
+        addressQueues[client.address].pending -= client.requests.count();
+
+    while (!client.requests.isEmpty())
+    {
+        quint64 id = client.requests.dequeue();
+        Pending &entry = requests[id];
+
+        // Clients that asked the same thing take the request over
+        if (!entry.req.followers.isEmpty())
+        {
+            entry.req.clientHandle = entry.req.followers.takeFirst();
+            schedule(id, entry.req.clientHandle, entry.followerAddresses.takeFirst());
+        }
+        else
+        {
+            requestsByKey.remove(entry.key);
+            requests.remove(id);
+        }
+    }
+}
+
+int AirinLogScheduler::count() const
+{
+    return requests.count();
+}
+
+void AirinLogScheduler::schedule(quint64 requestId, quint64 clientHandle, const QString &address)
+{
+    bool clientWaits = clientQueues.contains(clientHandle);
+
+    ClientQueue &client = clientQueues[clientHandle];
+    client.address = address;
+    client.requests.enqueue(requestId);
+
+    if (!addressQueues.contains(address))
+    {
+        addressQueues[address].pending = 0;
+        addressOrder.enqueue(address);
+    }
+
+    AddressQueue &queue = addressQueues[address];
+    queue.pending++;
+
+    if (!clientWaits)
+        queue.clients.enqueue(clientHandle);
+}
@@ -0,0 +1,76 @@
+#ifndef AIRINLOGSCHEDULER_H
+#define AIRINLOGSCHEDULER_H
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QHash>
+#include <QQueue>
+#include <QString>
+#include <QStringList>
+
+#include "airindata.h"
+
+// Queued LOG requests (use_log_request_queue = true) and the order they are served in.
+// Addresses take turns, then clients of the same address take turns, then
+// requests of a client go in the order they came. So a reconnecting NAT full
+// of clients gets as much as a single client on its own address does.
+// A request that is the same as a pending one (same room, parameters and user)
+// is not queued again, its client is just added to the pending one's followers.
+class AirinLogScheduler
+{
+public:
+    enum Result {
+        Queued,
+        Merged,
+        QueueFull,
+        AddressFull
+    };
+
+    AirinLogScheduler();
+
+    void setLimits(int maxRequests, int maxPerAddress);
+
+    Result enqueue(const AirinLogRequest &req, const QString &login, const QString &address);
+    bool next(AirinLogRequest *req); // false if there's nothing to serve
+    void remove(quint64 clientHandle); // the client is gone, forget its requests
+
+    int count() const;
+
+private:
+    struct Pending
+    {
+        AirinLogRequest req;
+        QString key;
+        QStringList followerAddresses; // goes along with req.followers
+    };
+
+    struct ClientQueue
+    {
+        QString address;
+        QQueue<quint64> requests; // request IDs
+    };
+
+    struct AddressQueue
+    {
+        QQueue<quint64> clients; // handles, gone ones are skipped when their turn comes
+        int pending;
+    };
+
+    QHash<quint64, Pending> requests;
+    QHash<QString, quint64> requestsByKey;
+    QHash<quint64, ClientQueue> clientQueues;
+    QHash<QString, AddressQueue> addressQueues;
+    QQueue<QString> addressOrder;
+
+    quint64 nextRequestId;
+    int maxRequests;
+    int maxPerAddress;
+
+    void schedule(quint64 requestId, quint64 clientHandle, const QString &address);
+};
+
+#endif // AIRINLOGSCHEDULER_H
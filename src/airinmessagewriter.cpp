@@ -0,0 +1,268 @@
+#include "airinmessagewriter.h"
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QMutexLocker>
+#include <QElapsedTimer>
+
+AirinMessageWriter::AirinMessageWriter(QObject *parent) : QObject(parent)
+{
+    writerThread = new QThread();
+    flushTimer = NULL;
+    dbType = AirinDatabase::DatabaseMysql;
+    flushInterval = 200;
+    maxQueue = 10000;
+
+    qRegisterMetaType< QList<int> >("QList<int>");
+}
+
+AirinMessageWriter::~AirinMessageWriter()
+{
+    stop();
+    delete writerThread;
+}
+
+void AirinMessageWriter::setDatabase(AirinDatabase::DatabaseType type, QString host, QString database,
+                                     QString username, QString password)
+{
+    dbType = type;
+    dbHost = host;
+    dbName = database;
+    dbUser = username;
+    dbPassword = password;
+}
+
+void AirinMessageWriter::setFlushInterval(uint ms)
+{
+    flushInterval = ms;
+}
+
+void AirinMessageWriter::setMaxQueue(uint messages)
+{
+    maxQueue = messages;
+}
+
+void AirinMessageWriter::start()
+{
+    moveToThread(writerThread);
+    writerThread->start();
+
+    // SQL connection can only be used by the thread that made it
+    QMetaObject::invokeMethod(this, "openDatabase", Qt::QueuedConnection);
+}
+
+void AirinMessageWriter::stop()
+{
+    if (!writerThread->isRunning())
+        return;
+
+    QMetaObject::invokeMethod(this, "closeDatabase", Qt::BlockingQueuedConnection);
+
+    writerThread->quit();
+    writerThread->wait();
+}
+
+void AirinMessageWriter::enqueue(const AirinMessage &message)
+{
+    QList<AirinMessage> dropped;
+
+    mutex.lock();
+    queue.append(message);
+
+    while ((uint)queue.count() > maxQueue)
+        dropped.append(queue.takeFirst());
+    mutex.unlock();
+
+    if (!dropped.isEmpty())
+        emit messagesDropped(idsOf(dropped));
+}
+
+QList<AirinMessage> AirinMessageWriter::unsaved(const QString &room)
+{
+    QMutexLocker locker(&mutex);
+    QList<AirinMessage> result;
+
+    for (int i = 0; i < inFlight.count(); i++)
+        if (inFlight.at(i).room == room)
+            result.append(inFlight.at(i));
+
+    for (int i = 0; i < queue.count(); i++)
+        if (queue.at(i).room == room)
+            result.append(queue.at(i));
+
+    return result;
+}
+
+int AirinMessageWriter::pending()
+{
+    QMutexLocker locker(&mutex);
+    return queue.count() + inFlight.count();
+}
+
+bool AirinMessageWriter::insert(QSqlQuery &query, const AirinMessage &message)
+{
+    query.addBindValue(message.id);
+    query.addBindValue(message.login);
+    query.addBindValue(message.message);
+    query.addBindValue(message.name);
+    query.addBindValue(message.color);
+    query.addBindValue(message.visible);
+    query.addBindValue(message.room);
+    query.addBindValue(message.timestamp);
+
+    return query.exec();
+}
+
+void AirinMessageWriter::requeue(QList<AirinMessage> messages)
+{
+    QList<AirinMessage> dropped;
+
+    mutex.lock();
+    inFlight.clear();
+    queue = messages + queue;
+
+    while ((uint)queue.count() > maxQueue)
+        dropped.append(queue.takeFirst());
+    mutex.unlock();
+
+    if (!dropped.isEmpty())
+        emit messagesDropped(idsOf(dropped));
+}
+
+QList<int> AirinMessageWriter::idsOf(const QList<AirinMessage> &messages)
+{
+    QList<int> ids;
+
+    for (int i = 0; i < messages.count(); i++)
+        ids.append(messages.at(i).id);
+
+    return ids;
+}
+
+void AirinMessageWriter::openDatabase()
+{
+    database = QSqlDatabase::addDatabase(AirinDatabase::driverName(dbType), AIRIN_WRITER_CONNECTION);
+    database.setHostName(dbHost);
+    database.setDatabaseName(dbName);
+    database.setUserName(dbUser);
+    database.setPassword(dbPassword);
+
+    if (dbType == AirinDatabase::DatabaseSqlite)
+        database.setConnectOptions(AIRIN_SQLITE_OPTIONS);
+
+    if (!database.open())
+        emit flushFailed(database.lastError().text()); // flush() will try again
+
+    flushTimer = new QTimer(this);
+    connect (flushTimer, SIGNAL(timeout()), this, SLOT(flush()));
+    flushTimer->start(flushInterval);
+}
+
+void AirinMessageWriter::closeDatabase()
+{
+    if (flushTimer != NULL)
+        flushTimer->stop();
+
+    flush();
+
+    database.close();
+    database = QSqlDatabase();
+    QSqlDatabase::removeDatabase(AIRIN_WRITER_CONNECTION);
+}
+
+void AirinMessageWriter::flush()
+{
+    QList<AirinMessage> batch;
+
+    mutex.lock();
+    batch = queue;
+    inFlight = queue;
+    queue.clear();
+    mutex.unlock();
+
+    if (batch.isEmpty())
+        return;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if (!database.isOpen() && !database.open())
+    {
+        emit flushFailed(database.lastError().text());
+        requeue(batch);
+        return;
+    }
+
+    // IDs are reserved on the main thread, so they're inserted explicitly
+    QSqlQuery qsqAdd(database);
+    qsqAdd.prepare("INSERT INTO messages (message_id, message_author_login, message_text, "
+                   "message_author_name, message_name_color, message_visible, message_room, "
+                   "message_timestamp) VALUES (?,?,?,?,?,?,?,?)");
+
+    bool ok = database.transaction();
+    for (int i = 0; ok && i < batch.count(); i++)
+        ok = insert(qsqAdd, batch.at(i));
+
+    if (ok)
+        ok = database.commit();
+
+    int savedId = 0; // highest ID that is in the table now
+
+    for (int i = 0; ok && i < batch.count(); i++)
+        savedId = qMax(savedId, batch.at(i).id);
+
+    if (!ok)
+    {
+        QSqlError error = qsqAdd.lastError().isValid() ? qsqAdd.lastError() : database.lastError();
+        database.rollback();
+
+        if (error.type() == QSqlError::ConnectionError || !database.isOpen())
+        {
+            emit flushFailed(error.text());
+            database.close(); // will be reopened on the next flush
+            requeue(batch);
+            return;
+        }
+
+        // Database is alive but refused something in this batch,
+        // save what can be saved and give up on the rest
+        QList<int> dropped;
+        savedId = 0;
+
+        for (int i = 0; i < batch.count(); i++)
+        {
+            if (insert(qsqAdd, batch.at(i)))
+                savedId = qMax(savedId, batch.at(i).id);
+            else
+                dropped.append(batch.at(i).id);
+        }
+
+        if (!dropped.isEmpty())
+        {
+            emit flushFailed(error.text());
+            emit messagesDropped(dropped);
+        }
+    }
+
+    // Explicit IDs don't move the sequence in pgsql, so the next
+    // non-write-behind insert would collide without this.
+    // Only IDs that really got into the table matter here
+    if (dbType == AirinDatabase::DatabasePostgresql && savedId > 0)
+    {
+        QSqlQuery qsqSeq(database);
+        qsqSeq.prepare("SELECT setval('seq_messages_message_id', "
+                       "GREATEST(?, (SELECT last_value FROM seq_messages_message_id)))");
+        qsqSeq.addBindValue(savedId);
+        qsqSeq.exec();
+    }
+
+    mutex.lock();
+    inFlight.clear();
+    mutex.unlock();
+
+    emit flushed(batch.count(), timer.elapsed());
+}
@@ -0,0 +1,84 @@
+#ifndef AIRINMESSAGEWRITER_H
+#define AIRINMESSAGEWRITER_H
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+#include <QMutex>
+#include <QList>
+#include <QString>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QVariant>
+
+#include "airindata.h"
+#include "airindatabase.h"
+
+#define AIRIN_WRITER_CONNECTION "airin_writer"
+
+// Write-behind storage for chat messages. Messages are accepted with an ID
+// reserved by AirinDatabase and broadcast right away, then this writer
+// inserts them in batches on its own thread using its own SQL connection.
+//
+// Failure policy: a reserved ID is never given to another message. If the
+// database is gone, the batch goes back to the queue and is retried on the
+// next flush. When the queue grows over its limit the oldest messages are
+// dropped and reported with messagesDropped(), their IDs just become gaps.
+// A batch rejected by the server itself (not a connection problem) is
+// retried row by row and only the broken rows are dropped.
+class AirinMessageWriter : public QObject
+{
+    Q_OBJECT
+public:
+    explicit AirinMessageWriter(QObject *parent = 0);
+    ~AirinMessageWriter();
+
+    void setDatabase(AirinDatabase::DatabaseType type, QString host, QString database,
+                     QString username, QString password);
+    void setFlushInterval(uint ms);
+    void setMaxQueue(uint messages);
+
+    void start();
+    void stop(); // blocks until everything possible is saved
+
+    void enqueue(const AirinMessage &message);
+    QList<AirinMessage> unsaved(const QString &room);
+    int pending();
+
+private:
+    QThread *writerThread;
+    QTimer *flushTimer;
+    QSqlDatabase database; // belongs to the writer thread only
+
+    AirinDatabase::DatabaseType dbType;
+    QString dbHost, dbName, dbUser, dbPassword;
+    uint flushInterval;
+    uint maxQueue;
+
+    QMutex mutex; // guards both lists below
+    QList<AirinMessage> queue;    // waiting for the next flush
+    QList<AirinMessage> inFlight; // being inserted right now
+
+    bool insert(QSqlQuery &query, const AirinMessage &message);
+    void requeue(QList<AirinMessage> messages);
+    static QList<int> idsOf(const QList<AirinMessage> &messages);
+
+private slots:
+    void openDatabase();
+    void closeDatabase();
+    void flush();
+
+signals:
+    void flushed(int count, qint64 elapsed);
+    void flushFailed(QString error);
+    void messagesDropped(QList<int> ids);
+};
+
+#endif // AIRINMESSAGEWRITER_H
@@ -0,0 +1,199 @@
+#include "airinpgpipeline.h"
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+AirinPgPipeline::AirinPgPipeline(QObject *parent) : QObject(parent)
+{
+    conn = NULL;
+    readNotifier = NULL;
+    writeNotifier = NULL;
+    nextTicket = 1;
+    pendingSyncs = 0;
+}
+
+AirinPgPipeline::~AirinPgPipeline()
+{
+    close();
+}
+
+bool AirinPgPipeline::start(QString host, QString database, QString username, QString password)
+{
+    close();
+
+    QByteArray h = host.toUtf8(), d = database.toUtf8(),
+               u = username.toUtf8(), p = password.toUtf8();
+
+    const char *keys[] = { "host", "dbname", "user", "password", NULL };
+    const char *values[] = { h.constData(), d.constData(), u.constData(), p.constData(), NULL };
+
+    log (QString("Setting up an async PostgreSQL connection on %1@%2...").arg(database).arg(host));
+
+    // Connecting is blocking, but it's done once on start just like QtSql does
+    conn = PQconnectdbParams(keys, values, 0);
+
+    if (PQstatus(conn) != CONNECTION_OK)
+    {
+        log ("Async PostgreSQL connection failed: "+QString::fromUtf8(PQerrorMessage(conn)), LL_ERROR);
+        close();
+        return false;
+    }
+
+    if (PQsetnonblocking(conn, 1) != 0 || PQenterPipelineMode(conn) != 1)
+    {
+        log ("Could not switch libpq to pipeline mode: "+QString::fromUtf8(PQerrorMessage(conn)), LL_ERROR);
+        close();
+        return false;
+    }
+
+    readNotifier = new QSocketNotifier(PQsocket(conn), QSocketNotifier::Read, this);
+    connect (readNotifier, SIGNAL(activated(int)), this, SLOT(socketReadable()));
+
+    writeNotifier = new QSocketNotifier(PQsocket(conn), QSocketNotifier::Write, this);
+    writeNotifier->setEnabled(false); // only while libpq has something left to send
+    connect (writeNotifier, SIGNAL(activated(int)), this, SLOT(socketWritable()));
+
+    log ("Async PostgreSQL connection established, pipeline mode is on.", LL_INFO);
+    return true;
+}
+
+bool AirinPgPipeline::isActive()
+{
+    return conn != NULL;
+}
+
+int AirinPgPipeline::pending()
+{
+    return tickets.count();
+}
+
+quint64 AirinPgPipeline::addMessage(const AirinMessage &message)
+{
+    if (conn == NULL)
+        return 0;
+
+    QByteArray login = message.login.toUtf8(),
+               text = message.message.toUtf8(),
+               name = message.name.toUtf8(),
+               color = message.color.toUtf8(),
+               room = message.room.toUtf8();
+
+    const char *params[] = {
+        login.constData(), text.constData(), name.constData(), color.constData(),
+        message.visible ? "true" : "false", room.constData()
+    };
+
+    // Every insert gets its own sync point, so a broken row doesn't abort the ones after it
+    if (PQsendQueryParams(conn, "INSERT INTO messages (message_author_login, message_text, "
+                                "message_author_name, message_name_color, message_visible, message_room) "
+                                "VALUES ($1,$2,$3,$4,$5,$6) RETURNING message_id",
+                          6, NULL, params, NULL, NULL, 0) != 1
+        || PQpipelineSync(conn) != 1)
+    {
+        fail(QString::fromUtf8(PQerrorMessage(conn)));
+        return 0;
+    }
+
+    quint64 ticket = nextTicket++;
+    tickets.enqueue(ticket);
+    pendingSyncs++;
+
+    // Sending is left to socketWritable(): if it fails right here, the ticket's
+    // result would be emitted before the caller even knows the ticket
+    writeNotifier->setEnabled(true);
+    return ticket;
+}
+
+void AirinPgPipeline::flush()
+{
+    int result = PQflush(conn);
+
+    if (result < 0)
+        fail(QString::fromUtf8(PQerrorMessage(conn)));
+    else
+        writeNotifier->setEnabled(result == 1);
+}
+
+void AirinPgPipeline::socketWritable()
+{
+    if (conn != NULL)
+        flush();
+}
+
+void AirinPgPipeline::socketReadable()
+{
+    if (conn == NULL)
+        return;
+
+    if (PQconsumeInput(conn) != 1)
+    {
+        fail(QString::fromUtf8(PQerrorMessage(conn)));
+        return;
+    }
+
+    while (conn != NULL && pendingSyncs > 0 && !PQisBusy(conn))
+    {
+        PGresult *res = PQgetResult(conn);
+
+        if (res == NULL) // end of one statement's results
+            continue;
+
+        ExecStatusType status = PQresultStatus(res);
+
+        if (status == PGRES_PIPELINE_SYNC)
+            pendingSyncs--;
+        else
+        if (!tickets.isEmpty())
+        {
+            int messageId = -1;
+
+            if (status == PGRES_TUPLES_OK && PQntuples(res) > 0)
+                messageId = QByteArray(PQgetvalue(res, 0, 0)).toInt();
+            else
+                log ("Message addition SQL error: "+QString::fromUtf8(PQresultErrorMessage(res)), LL_WARNING);
+
+            emit messageAdded(tickets.dequeue(), messageId);
+        }
+
+        PQclear(res);
+    }
+
+    if (conn != NULL && PQstatus(conn) == CONNECTION_BAD)
+        fail(QString::fromUtf8(PQerrorMessage(conn)));
+}
+
+void AirinPgPipeline::fail(QString error)
+{
+    log ("Async PostgreSQL connection is lost: "+error.trimmed(), LL_WARNING);
+
+    QQueue<quint64> lost = tickets;
+    close();
+
+    while (!lost.isEmpty())
+        emit messageAdded(lost.dequeue(), -1);
+
+    emit connectionLost();
+}
+
+void AirinPgPipeline::close()
+{
+    delete readNotifier;
+    delete writeNotifier;
+    readNotifier = NULL;
+    writeNotifier = NULL;
+
+    if (conn != NULL)
+        PQfinish(conn);
+
+    conn = NULL;
+    tickets.clear();
+    pendingSyncs = 0;
+}
+
+void AirinPgPipeline::log(QString message, LogLevel level)
+{
+    AirinLogger::instance->log(message, level, "pgpipe");
+}
@@ -0,0 +1,62 @@
+#ifndef AIRINPGPIPELINE_H
+#define AIRINPGPIPELINE_H
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QObject>
+#include <QString>
+#include <QQueue>
+#include <QSocketNotifier>
+
+#include <libpq-fe.h>
+
+#include "airindata.h"
+#include "airinlogger.h"
+
+// A PostgreSQL connection made directly on libpq, used for message inserts
+// when dbms = pgsql-async. It never blocks: statements are sent in pipeline
+// mode, so many of them can be on the wire at once, and results are read
+// when the socket says so. Every insert gets a ticket, the result comes
+// back with messageAdded() for the same ticket, always in sending order.
+// Needs libpq from PostgreSQL 14 or newer.
+class AirinPgPipeline : public QObject
+{
+    Q_OBJECT
+public:
+    explicit AirinPgPipeline(QObject *parent = 0);
+    ~AirinPgPipeline();
+
+    bool start(QString host, QString database, QString username, QString password);
+    bool isActive();
+    int pending();
+
+    quint64 addMessage(const AirinMessage &message); // 0 if it could not be sent
+
+private:
+    PGconn *conn;
+    QSocketNotifier *readNotifier;
+    QSocketNotifier *writeNotifier;
+
+    QQueue<quint64> tickets; // sent, waiting for their results
+    quint64 nextTicket;
+    int pendingSyncs;
+
+    void flush();
+    void fail(QString error);
+    void close();
+    void log(QString message, LogLevel level = LL_DEBUG);
+
+private slots:
+    void socketReadable();
+    void socketWritable();
+
+signals:
+    void messageAdded(quint64 ticket, int messageId); // -1 on error
+    void connectionLost();
+};
+
+#endif // AIRINPGPIPELINE_H
@@ -0,0 +1,166 @@
+#include "airinregistry.h"
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+AirinClientRegistry::AirinClientRegistry()
+{
+    nextHandle = 1; // zero handle is never valid
+}
+
+quint64 AirinClientRegistry::add(AirinClient *client)
+{
+    if (entries.contains(client))
+        return entries.value(client).handle;
+
+    Entry entry;
+    entry.handle = nextHandle++;
+    entry.externalId = client->externalId();
+    entry.hash = client->hash();
+    entry.address = client->remoteAddress();
+
+    entries.insert(client, entry);
+    handles.insert(entry.handle, client);
+
+    if (!entry.externalId.isEmpty())
+        externalIds.insert(entry.externalId, client);
+
+    hashes.insert(entry.hash, client);
+    addresses.insert(entry.address, client);
+
+    return entry.handle;
+}
+
+void AirinClientRegistry::remove(AirinClient *client)
+{
+    // The client may be already destroyed here, so it is used only as a key
+    if (!entries.contains(client))
+        return;
+
+    Entry entry = entries.take(client);
+
+    handles.remove(entry.handle);
+    externalIds.remove(entry.externalId, client);
+    hashes.remove(entry.hash, client);
+    addresses.remove(entry.address, client);
+
+    foreach (const QString &room, entry.rooms)
+    {
+        roomMembers[room].remove(client);
+
+        if (roomMembers.value(room).isEmpty())
+            roomMembers.remove(room);
+    }
+}
+
+void AirinClientRegistry::reindex(AirinClient *client)
+{
+    if (!entries.contains(client))
+        return;
+
+    Entry &entry = entries[client];
+
+    if (entry.externalId == client->externalId())
+        return;
+
+    externalIds.remove(entry.externalId, client);
+    entry.externalId = client->externalId();
+
+    if (!entry.externalId.isEmpty())
+        externalIds.insert(entry.externalId, client);
+}
+
+bool AirinClientRegistry::join(AirinClient *client, const QString &room)
+{
+    if (!entries.contains(client) || entries.value(client).rooms.contains(room))
+        return false;
+
+    entries[client].rooms.insert(room);
+    roomMembers[room].insert(client);
+    return true;
+}
+
+bool AirinClientRegistry::part(AirinClient *client, const QString &room)
+{
+    if (!entries.contains(client) || !entries.value(client).rooms.contains(room))
+        return false;
+
+    entries[client].rooms.remove(room);
+    roomMembers[room].remove(client);
+
+    if (roomMembers.value(room).isEmpty())
+        roomMembers.remove(room);
+
+    return true;
+}
+
+bool AirinClientRegistry::isInRoom(AirinClient *client, const QString &room) const
+{
+    return entries.value(client).rooms.contains(room);
+}
+
+bool AirinClientRegistry::contains(AirinClient *client) const
+{
+    return entries.contains(client);
+}
+
+quint64 AirinClientRegistry::handle(AirinClient *client) const
+{
+    return entries.value(client).handle;
+}
+
+AirinClient *AirinClientRegistry::byHandle(quint64 handle) const
+{
+    return handles.value(handle, NULL);
+}
+
+QList<AirinClient *> AirinClientRegistry::all() const
+{
+    return entries.keys();
+}
+
+QList<AirinClient *> AirinClientRegistry::byExternalId(const QString &externalId) const
+{
+    if (externalId.isEmpty())
+        return QList<AirinClient *>();
+
+    return externalIds.values(externalId);
+}
+
+QList<AirinClient *> AirinClientRegistry::byHash(const QString &hash) const
+{
+    return hashes.values(hash);
+}
+
+QList<AirinClient *> AirinClientRegistry::byAddress(const QString &address) const
+{
+    return addresses.values(address);
+}
+
+QList<AirinClient *> AirinClientRegistry::byRoom(const QString &room) const
+{
+    return roomMembers.value(room).toList();
+}
+
+QStringList AirinClientRegistry::rooms(AirinClient *client) const
+{
+    return entries.value(client).rooms.toList();
+}
+
+int AirinClientRegistry::count() const
+{
+    return entries.count();
+}
+
+AirinClientRegistry::const_iterator AirinClientRegistry::begin() const
+{
+    return entries.constBegin();
+}
+
+AirinClientRegistry::const_iterator AirinClientRegistry::end() const
+{
+    return entries.constEnd();
+}
@@ -0,0 +1,74 @@
+#ifndef AIRINREGISTRY_H
+#define AIRINREGISTRY_H
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QHash>
+#include <QMultiHash>
+#include <QList>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+
+#include "airinclient.h"
+
+// All the connected clients indexed by the keys Airin looks them up with.
+// Every client also gets a handle that is never reused, so delayed jobs
+// (like queued LOG requests) can check if their client is still alive.
+class AirinClientRegistry
+{
+public:
+    struct Entry
+    {
+        quint64 handle;
+        QString externalId;
+        QString hash;
+        QString address;
+        QSet<QString> rooms;
+    };
+
+    typedef QHash<AirinClient *, Entry>::const_iterator const_iterator;
+
+    AirinClientRegistry();
+
+    quint64 add(AirinClient *client);
+    void remove(AirinClient *client);
+    void reindex(AirinClient *client); // call it when client's external id is changed
+
+    bool join(AirinClient *client, const QString &room);
+    bool part(AirinClient *client, const QString &room);
+    bool isInRoom(AirinClient *client, const QString &room) const;
+
+    bool contains(AirinClient *client) const;
+    quint64 handle(AirinClient *client) const;
+    AirinClient *byHandle(quint64 handle) const;
+
+    QList<AirinClient *> all() const;
+    QList<AirinClient *> byExternalId(const QString &externalId) const;
+    QList<AirinClient *> byHash(const QString &hash) const;
+    QList<AirinClient *> byAddress(const QString &address) const;
+    QList<AirinClient *> byRoom(const QString &room) const;
+    QStringList rooms(AirinClient *client) const;
+
+    int count() const;
+    const_iterator begin() const;
+    const_iterator end() const;
+
+private:
+    QHash<AirinClient *, Entry> entries;
+    QHash<quint64, AirinClient *> handles;
+    QMultiHash<QString, AirinClient *> externalIds;
+    QMultiHash<QString, AirinClient *> hashes;
+    QMultiHash<QString, AirinClient *> addresses;
+
+    // Rooms are big, so members are kept in sets to be removed in O(1)
+    QHash<QString, QSet<AirinClient *> > roomMembers;
+
+    quint64 nextHandle;
+};
+
+#endif // AIRINREGISTRY_H
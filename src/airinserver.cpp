@@ -1,5 +1,11 @@
 #include "airinserver.h"
 
+#include <algorithm>
+
+#ifdef AIRIN_LIBPQ
+#include "airinpgpipeline.h"
+#endif
+
 /*
         This is Airin 4, an advanced WebSocket chat server
      Licensed under the new BSD 3-Clause license, see LICENSE
@@ -9,6 +15,16 @@
 AirinServer::AirinServer(QString config, QObject *parent) : QObject(parent), config(config)
 {
     serverReady = false;
+    contentBatchTimer = NULL;
+    archiveTimer = NULL;
+    logStreamTimer = NULL;
+    hiddenAuthorsKnown = false;
+    hiddenAuthorsLoading = false;
+    archiveRunning = false;
+    messageWriter = NULL;
+    pgPipeline = NULL;
+    sendQueueEvictionsCount = 0;
+    sendQueueDropsCount = 0;
 
         if (!QFile::exists(config))
         {
@@ -30,14 +46,10 @@ AirinServer::AirinServer(QString config, QObject *parent) : QObject(parent), con
         AirinDatabase::db = new AirinDatabase();
         connect (AirinDatabase::db, SIGNAL(databaseFailed()), this, SLOT(databaseOnFault()));
 
-        AirinDatabase::DatabaseType dbt;
+        bool dbtOk;
+        AirinDatabase::DatabaseType dbt = AirinDatabase::typeByName(sqlDbType, &dbtOk);
 
-        if (sqlDbType == "mysql")
-            dbt = AirinDatabase::DatabaseMysql;
-        else
-        if (sqlDbType == "pgsql")
-            dbt = AirinDatabase::DatabasePostgresql;
-        else
+        if (!dbtOk)
         {
             log ("Bad database type specified, exiting!");
             exit(1);
@@ -45,6 +57,10 @@ AirinServer::AirinServer(QString config, QObject *parent) : QObject(parent), con
 
         AirinDatabase::db->setDatabaseType(dbt);
 
+        if (useReplica)
+            AirinDatabase::db->setReplica(replicaHost, replicaDatabase, replicaUsername, replicaPassword,
+                                          replicaRetryTimeout);
+
         databaseReconnectCount = 0;
         setupDatabase();
 
@@ -59,7 +75,21 @@ AirinServer::AirinServer(QString config, QObject *parent) : QObject(parent), con
 
 AirinServer::~AirinServer()
 {
+    if (messageWriter != NULL)
+    {
+        log (QString("Saving %1 pending messages before exit...").arg(messageWriter->pending()), LL_INFO);
+        delete messageWriter; // stops and flushes it
+    }
+
+#ifdef AIRIN_LIBPQ
+    delete pgPipeline;
+#endif
 
+    for (int i = 0; i < ioWorkers.count(); i++)
+        ioWorkers.at(i)->stop();
+
+    for (int i = 0; i < dbWorkers.count(); i++)
+        dbWorkers.at(i)->stop();
 }
 
 uint AirinServer::clientsCount()
@@ -69,57 +99,155 @@ uint AirinServer::clientsCount()
 
 QList<AirinClient *> AirinServer::getClients()
 {
-    return clients;
+    return clients.all();
 }
 
 
 void AirinServer::disconnectClientsByXId(QString externalId)
 {
-    for (int i = 0; i < clients.count(); i++)
-    {
-        if (clients.at(i)->externalId() == externalId)
-            clients.at(i)->close();
-    }
+    QList<AirinClient *> found = clients.byExternalId(externalId);
+
+    for (int i = 0; i < found.count(); i++)
+        found.at(i)->close();
 }
 
 void AirinServer::disconnectClientsByAddress(QString address)
 {
-    for (int i = 0; i < clients.count(); i++)
-    {
-        if (clients.at(i)->remoteAddress() == "::ffff:"+address) // IPv6 Workaround
-            clients.at(i)->close();
-    }
+    QList<AirinClient *> found = clients.byAddress("::ffff:"+address); // IPv6 Workaround
+
+    for (int i = 0; i < found.count(); i++)
+        found.at(i)->close();
 }
 
 void AirinServer::disconnectClientsByHash(QString hash)
 {
-    for (int i = 0; i < clients.count(); i++)
-    {
-        if (clients.at(i)->hash() == hash)
-            clients.at(i)->close();
-    }
+    QList<AirinClient *> found = clients.byHash(hash);
+
+    for (int i = 0; i < found.count(); i++)
+        found.at(i)->close();
 }
 
 void AirinServer::broadcastForXId(QString externalId, QString message)
 {
     log (QString("Message broadcast for XID %1: %2").arg(externalId).arg(message));
 
-    for (int i = 0; i < clients.count(); i++)
+    AirinBroadcast payload(message);
+    payload.authorizedOnly = false;
+
+    broadcast(payload, externalId);
+}
+
+void AirinServer::broadcast(const AirinBroadcast &payload, const QString &externalId)
+{
+    // The payload is already serialized, so here we only pick the recipients
+    // and hand every one of them the same shared string. Only the serialization
+    // is shared: QWebSocket::sendTextMessage() still converts the text to UTF-8
+    // for every socket, QtWebSockets has no way to send a pre-encoded text frame.
+    QElapsedTimer timer;
+    timer.start();
+
+    // Batched CONTENT lines must not be overtaken by anything sent after them
+    if (!contentBatches.isEmpty() &&
+        (payload.maxApiLevel == 0 || payload.maxApiLevel >= AIRIN_BATCH_API_LEVEL))
+        flushContentBatch();
+
+    uint recipients = 0;
+
+    // In threaded mode recipients are batched per I/O thread,
+    // so every thread gets one queued delivery per payload variant.
+    QHash<QThread *, AirinClientList> batches, legacyBatches, binaryBatches;
+
+    // Compressed once for all the clients that asked for compression
+    QByteArray compressed, legacyCompressed;
+
+    // Fan-out cost depends on the size of the room, not on the whole online
+    QList<AirinClient *> selected;
+    if (!externalId.isEmpty())
+        selected = clients.byExternalId(externalId);
+    else
+        selected = payload.room.isEmpty() ? clients.all() : clients.byRoom(payload.room);
+
+    for (int i = 0; i < selected.count(); i++)
+    {
+        AirinClient *client = selected.at(i); // cache
+
+        if (!externalId.isEmpty() && !payload.room.isEmpty() && !clients.isInRoom(client, payload.room))
+            continue;
+
+        if (payload.authorizedOnly && !client->isAuthorized() && !client->isReadonly())
+            continue;
+
+        if (payload.minApiLevel > 0 && client->apiLevel() < payload.minApiLevel)
+            continue;
+
+        if (payload.maxApiLevel > 0 && client->apiLevel() > payload.maxApiLevel)
+            continue;
+
+        if (!payload.binary.isEmpty() && client->isBinaryProtocol())
+        {
+            if (!ioWorkers.isEmpty())
+                binaryBatches[client->thread()].append(client);
+            else
+                client->writeBinary(payload.message, payload.binary, payload.droppable);
+
+            recipients++;
+            continue;
+        }
+
+        bool legacy = (payload.legacyLevel > 0 && client->apiLevel() < payload.legacyLevel);
+        const QString &message = legacy ? payload.legacyMessage : payload.message;
+        QByteArray &messageCompressed = legacy ? legacyCompressed : compressed;
+
+        if (messageCompressed.isEmpty() && client->compressionThreshold() > 0 &&
+            (uint)message.length() >= client->compressionThreshold())
+            messageCompressed = AirinClient::compress(message);
+
+        if (!ioWorkers.isEmpty())
+            (legacy ? legacyBatches : batches)[client->thread()].append(client);
+        else
+            client->writeFrame(message, messageCompressed, payload.droppable);
+
+        recipients++;
+    }
+
+    for (int i = 0; i < ioWorkers.count(); i++)
     {
-        if (clients.at(i)->externalId() == externalId)
-            clients.at(i)->sendMessage(message);
+        AirinWorker *worker = ioWorkers.at(i);
+
+        if (batches.contains(worker->workerThread()))
+            QMetaObject::invokeMethod(worker, "deliver", Qt::QueuedConnection,
+                                      Q_ARG(AirinClientList, batches.value(worker->workerThread())),
+                                      Q_ARG(QString, payload.message),
+                                      Q_ARG(QByteArray, compressed),
+                                      Q_ARG(bool, payload.droppable));
+
+        if (legacyBatches.contains(worker->workerThread()))
+            QMetaObject::invokeMethod(worker, "deliver", Qt::QueuedConnection,
+                                      Q_ARG(AirinClientList, legacyBatches.value(worker->workerThread())),
+                                      Q_ARG(QString, payload.legacyMessage),
+                                      Q_ARG(QByteArray, legacyCompressed),
+                                      Q_ARG(bool, payload.droppable));
+
+        if (binaryBatches.contains(worker->workerThread()))
+            QMetaObject::invokeMethod(worker, "deliverBinary", Qt::QueuedConnection,
+                                      Q_ARG(AirinClientList, binaryBatches.value(worker->workerThread())),
+                                      Q_ARG(QString, payload.message),
+                                      Q_ARG(QByteArray, payload.binary),
+                                      Q_ARG(bool, payload.droppable));
     }
+
+    log (QString("Broadcast for %1 of %2 clients took %3 us")
+         .arg(recipients).arg(clients.count()).arg(timer.nsecsElapsed() / 1000));
 }
 
 void AirinServer::setShadowbanned(QString externalId, bool isShBanned)
 {
     log (QString("Setting shadowban flag for XID %1").arg(externalId));
 
-    for (int i = 0; i < clients.count(); i++)
-    {
-        if (clients.at(i)->externalId() == externalId)
-            clients.at(i)->setShadowBanned(isShBanned);
-    }
+    QList<AirinClient *> found = clients.byExternalId(externalId);
+
+    for (int i = 0; i < found.count(); i++)
+        found.at(i)->setShadowBanned(isShBanned);
 }
 
 QString AirinServer::defaultChatName()
@@ -128,15 +256,19 @@ QString AirinServer::defaultChatName()
 }
 
 
-bool AirinServer::isOnline(QString externalId)
+uint AirinServer::sendQueueEvictions()
 {
-    for (int i = 0; i < clients.count(); i++)
-    {
-        if (clients.at(i)->externalId() == externalId)
-            return true;
-    }
+    return sendQueueEvictionsCount;
+}
+
+uint AirinServer::sendQueueDrops()
+{
+    return sendQueueDropsCount;
+}
 
-    return false;
+bool AirinServer::isOnline(QString externalId)
+{
+    return !clients.byExternalId(externalId).isEmpty();
 }
 
 
@@ -164,6 +296,11 @@ void AirinServer::loadConfig(QString configName)
     sslIntermediateCertFile = settings->value("ssl_intermediate_cert", "").toString();
     sslKeyFile = settings->value("ssl_key", "").toString();
 
+    // Sockets are served by this amount of I/O threads, 0 keeps everything on the main one
+    ioThreadsCount = settings->value("io_threads", 0).toUInt();
+    if (ioThreadsCount > 64)
+        ioThreadsCount = 0;
+
     // Without a database Airin will use her defaults and won't be able to save messages
     continueWithoutDB = settings->value("continue_on_db_fault", false).toBool();
 
@@ -180,8 +317,14 @@ void AirinServer::loadConfig(QString configName)
 
     settings->beginGroup("database");
     sqlDbType = settings->value("dbms", "mysql").toString();
+
+    // Same PostgreSQL, but messages go through libpq directly
+    useAsyncPostgres = (sqlDbType == "pgsql-async");
+    if (useAsyncPostgres)
+        sqlDbType = "pgsql";
+
     sqlHost = settings->value("hostname", "localhost").toString();
-    sqlDatabase = settings->value("database", "airin").toString();
+    sqlDatabase = settings->value("database", "airin").toString(); // a file path for sqlite
     sqlUsername = settings->value("username", "airin").toString();
     sqlPassword = settings->value("password", "paswd").toString();
     sqlServerPing = settings->value("server_ping", 0).toUInt();
@@ -191,6 +334,38 @@ void AirinServer::loadConfig(QString configName)
     maxDatabaseReconnectCount = settings->value("reconnect_attempts", 0).toUInt();
     databaseRetryTimeout = settings->value("reconnect_timeout", 1000).toUInt();
 
+    // Let Airin upgrade the schema herself, otherwise she only checks it and complains
+    autoMigrate = settings->value("migrate", false).toBool();
+
+    // Each thread has its own connection, 0 runs all the queries on the main thread
+    dbThreadsCount = settings->value("threads", 0).toUInt();
+    if (dbThreadsCount > 32)
+        dbThreadsCount = 0;
+
+    // Write-behind: messages are broadcast at once and saved in batches by a separate thread
+    useWriteBehind = settings->value("write_behind", false).toBool();
+    writeBehindInterval = settings->value("write_behind_interval", 200).toUInt();
+    if (writeBehindInterval <= 0 || writeBehindInterval > 60000)
+        writeBehindInterval = 200;
+
+    writeBehindMaxQueue = settings->value("write_behind_max_queue", 10000).toUInt();
+    if (writeBehindMaxQueue <= 0)
+        writeBehindMaxQueue = 10000;
+
+    settings->endGroup();
+
+    // LOG, /whois, /whowas, /ban list and /message read from here, the same dbms as [database].
+    // Writes, auth and config always stay on the primary.
+    settings->beginGroup("database_replica");
+    useReplica = settings->value("enable", false).toBool() && sqlDbType != "sqlite";
+    replicaHost = settings->value("hostname", "localhost").toString();
+    replicaDatabase = settings->value("database", sqlDatabase).toString();
+    replicaUsername = settings->value("username", sqlUsername).toString();
+    replicaPassword = settings->value("password", sqlPassword).toString();
+    replicaRetryTimeout = settings->value("reconnect_timeout", 5000).toUInt();
+    if (replicaRetryTimeout < 100)
+        replicaRetryTimeout = 5000;
+
     settings->endGroup();
 }
 
@@ -237,12 +412,94 @@ void AirinServer::loadConfigFromDatabase()
         minMessageDelay = 5;
 
     maxLogQueryQueueLength = config.value("max_log_queue_length", 50).toUInt();
-    if (maxLogQueryQueueLength > 256)
+    if (maxLogQueryQueueLength > 4096) // requests are small, the scheduler keeps them fair
         maxLogQueryQueueLength = 10;
 
     logQueueFlushTimeout = config.value("log_queue_flush_timeout", 500).toUInt();
-    if (maxLogQueryQueueLength > 10000)
-        maxLogQueryQueueLength = 500;
+    if (logQueueFlushTimeout <= 0 || logQueueFlushTimeout > 10000)
+        logQueueFlushTimeout = 500;
+
+    // Queued requests are served for that long (ms) on every tick, one address can hold that many of them
+    logQueueBudget = config.value("log_queue_budget", 50).toUInt();
+    if (logQueueBudget > logQueueFlushTimeout)
+        logQueueBudget = logQueueFlushTimeout / 2;
+
+    uint maxLogQueuePerAddress = config.value("max_log_queue_per_address", 10).toUInt();
+    if (maxLogQueuePerAddress <= 0 || maxLogQueuePerAddress > maxLogQueryQueueLength)
+        maxLogQueuePerAddress = qMin((uint)10, maxLogQueryQueueLength);
+
+    logScheduler.setLimits(maxLogQueryQueueLength, maxLogQueuePerAddress);
+
+    // Slow consumers: limits of data waiting to be sent to a single client, 0 is unlimited
+    sendQueueMaxBytes = config.value("send_queue_max_bytes", 4194304).toUInt();
+    sendQueueMaxFrames = config.value("send_queue_max_frames", 2000).toUInt();
+
+    QString policy = config.value("send_queue_policy", "drop").toString();
+    if (policy == "disconnect")
+        sendQueuePolicy = AirinClient::SendQueueDisconnect;
+    else
+    {
+        if (policy != "drop")
+            log ("Bad send queue policy! Old chat lines will be dropped.", LL_WARNING);
+
+        sendQueuePolicy = AirinClient::SendQueueDropOldest;
+    }
+
+    // CONTENT lines are gathered for that long (ms) for clients of batching API level, 0 disables it
+    contentBatchWindow = config.value("content_batch_window", 100).toUInt();
+    if (contentBatchWindow > 1000)
+        contentBatchWindow = 100;
+
+    // Auth sessions, ban states and admin ACL are cached for that long (seconds), 0 disables it
+    uint authCacheTtl = config.value("auth_cache_ttl", 60).toUInt();
+    if (authCacheTtl > 86400)
+        authCacheTtl = 60;
+
+    uint authCacheSize = config.value("auth_cache_size", 10000).toUInt();
+    if (authCacheSize <= 0 || authCacheSize > 1000000)
+        authCacheSize = 10000;
+
+    AirinDatabase::setAuthCacheLimits(authCacheTtl, authCacheSize);
+
+    // Last messages of every room are kept in memory for LOG requests, 0 disables it
+    historySize = config.value("history_size", 200).toUInt();
+    if (historySize > 10000)
+        historySize = 200;
+
+    history.setCapacity(historySize);
+
+    // Messages older than that (days) are moved to the archive table, 0 keeps them all in place
+    archiveAfterDays = config.value("archive_after_days", 0).toUInt();
+    if (archiveAfterDays > 36500)
+        archiveAfterDays = 0;
+
+    archiveBatchSize = config.value("archive_batch_size", 5000).toUInt();
+    if (archiveBatchSize < 100 || archiveBatchSize > 100000)
+        archiveBatchSize = 5000;
+
+    archiveInterval = config.value("archive_interval", 60).toUInt(); // minutes
+    if (archiveInterval <= 0 || archiveInterval > 10080)
+        archiveInterval = 60;
+
+    if (archiveTimer != NULL)
+        archiveTimer->setInterval(archiveInterval * 60000);
+
+    // LOG answers are sent that many lines at a time, other clients are served in between, 0 sends them at once
+    logChunkSize = config.value("log_chunk_size", 50).toUInt();
+    if (logChunkSize > 10000)
+        logChunkSize = 50;
+
+    // That many distinct LOG answers are kept encoded and shared, 0 disables it
+    uint logCacheSize = config.value("log_cache_size", 64).toUInt();
+    if (logCacheSize > 4096)
+        logCacheSize = 64;
+
+    logCache.setCapacity(logCacheSize);
+    logCache.clear(); // names and disclosed logins may be different now
+
+    maxRoomsPerClient = config.value("max_rooms_per_client", 8).toUInt();
+    if (maxRoomsPerClient <= 0 || maxRoomsPerClient > 256)
+        maxRoomsPerClient = 8;
 
     delayTroll = config.value("delay_troll", false).toBool();
     defaultUserName = config.value("default_username", "Anonyamous").toString();
@@ -253,6 +510,12 @@ void AirinServer::loadConfigFromDatabase()
     useMiscInfoAsName = config.value("use_misc_as_name", false).toBool();
     useLogRequestQueue = config.value("use_log_request_queue", false).toBool();
     useXffHeader = config.value("use_xff_header", false).toBool();
+    useCompression = config.value("use_compression", false).toBool();
+
+    // Short frames grow when compressed, so they are always sent as text
+    compressionMinSize = config.value("compression_min_size", 256).toUInt();
+    if (compressionMinSize < 64)
+        compressionMinSize = 256;
     deprecationMessage = config.value("deprecation_message", "Your API Level is deprecated, use higher one!").toString();
 
     log ("Database settings are loaded! :3", LL_INFO);
@@ -351,6 +614,8 @@ void AirinServer::setupServer()
     connect (server, SIGNAL(newConnection()), this, SLOT(serverNewConnection()));
     log (QString("Airin listens on port %1 and waits for clients :3").arg(serverPort), LL_INFO);
 
+    setupIoWorkers();
+
     if (useLogRequestQueue)
     {
         logRequestQueueTimer = new QTimer(this);
@@ -358,378 +623,663 @@ void AirinServer::setupServer()
         logRequestQueueTimer->start(logQueueFlushTimeout);
     }
 
+    contentBatchTimer = new QTimer(this);
+    contentBatchTimer->setSingleShot(true);
+    connect (contentBatchTimer, SIGNAL(timeout()), this, SLOT(flushContentBatch()));
+
+    archiveTimer = new QTimer(this);
+    connect (archiveTimer, SIGNAL(timeout()), this, SLOT(archiveMessages()));
+    archiveTimer->start(archiveInterval * 60000);
+
+    history.startChangeLog((int)AirinDatabase::db->lastMessage());
+
+    // Zero interval: the next chunk goes as soon as everything already waiting is served
+    logStreamTimer = new QTimer(this);
+    logStreamTimer->setSingleShot(true);
+    logStreamTimer->setInterval(0);
+    connect (logStreamTimer, SIGNAL(timeout()), this, SLOT(pumpLogStreams()));
+
     serverReady = true; // ok to process new connections
 }
 
-void AirinServer::processClientCommand(AirinClient *client, QString command)
+void AirinServer::setupIoWorkers()
 {
-    QStringList commands = command.split(' ', QString::SkipEmptyParts);
-    if (commands.count() == 0)
-        return;
+    nextIoWorker = 0;
 
-    QString mainCmd = QString(commands[0]).trimmed();
-    if (mainCmd.isEmpty())
+    if (ioThreadsCount == 0)
     {
-        client->sendMessage("FAIL 299 #Lol wut");
+        log ("Sockets will be served by the main thread.");
         return;
     }
 
-    /// LEVEL 1 ~ GENERIC AIRIN API
+    // Commands are still processed on the main thread one by one,
+    // so the chat order does not depend on the amount of I/O threads.
+    log (QString("Starting %1 I/O threads for client sockets...").arg(ioThreadsCount), LL_INFO);
 
-    if (mainCmd == "CONNECT" && (!client->isAuthorized() || client->isReadonly()))
+    for (uint i = 0; i < ioThreadsCount; i++)
     {
-        if (commands.count() < 3 || !chkString(command))
-        {
-            log ("Bad client/auth information. Disconnecting", LL_WARNING);
-            client->sendMessage("FAIL 299 #Syntax error");
-            client->close();
+        AirinWorker *worker = new AirinWorker();
+        worker->start();
+        ioWorkers.append(worker);
+    }
+}
 
-            logAdmin(QString("Somebody (%1 / %2) mismatches the protocol!").arg(client->remoteAddress()).arg(client->hash()), LL_WARNING);
-            return;
-        }
+// What processClientCommand() does with each AirinFrame::Command and since which API level.
+// A handler returns false if the command is not for this client right now
+// (e.g. it's not authorized), then the client gets the usual "unknown command".
+const AirinServer::CommandHandler AirinServer::commandTable[AirinFrame::CmdCount] = {
+    { 0, NULL },                                   // CmdUnknown
 
-        QString app = command.mid(command.indexOf("#")+1);
+    /// ROOM SCOPE ~ IN <room> <command> runs the command in that room
+    { 0, &AirinServer::processRoomScope },         // CmdIn
 
-        if (app.length() > 256)
-        {
-            log ("Client tries to set too long app name, reducing");
-            app = app.mid(0, 253)+"...";
-        }
+    /// LEVEL 1 ~ GENERIC AIRIN API
+    { 1, &AirinServer::processConnect },           // CmdConnect
+    { 1, &AirinServer::processLevel },             // CmdLevel
+    { 1, &AirinServer::processContent },           // CmdContent
+    { 1, &AirinServer::processIam },               // CmdIam
+    { 1, &AirinServer::processLog },               // CmdLog
+    { 1, &AirinServer::processAuthChange },        // CmdLogoff
+    { 1, &AirinServer::processAuthChange },        // CmdDowngrade
 
-        client->setApplication(app);
+    /// LEVEL 2 : COMMANDS + REPORTS SUPPORT
+    // There were some functions that are specific to provoda.ch
+    // So this level is useless in open source version of Airin.
 
-        log(QString ("Client %1:%2 uses %3").arg(clients.indexOf(client))
-            .arg(client->hash()).arg(client->app()));
+    /// LEVEL 3 : MESSAGE REMOVAL, REMOTE PARAMETERS, RESTART, SUS
+    { 3, &AirinServer::processGetset },            // CmdGetset
+    { 3, &AirinServer::processSus },               // CmdSus
+    { 3, &AirinServer::processCompress },          // CmdCompress
 
+    /// LEVEL 4 : BATCHED CONTENT, ROOMS
+    { 4, &AirinServer::processRoomChange },        // CmdJoin
+    { 4, &AirinServer::processRoomChange },        // CmdPart
 
-            if (commands[1] == "READONLY")
-            {
-                if (!readonlyAllowed)
-                {
-                    client->sendMessage("FAIL 299 #Read-only mode is not allowed in server configuration.");
-                    return;
-                }
+    /// LEVEL 5 : BINARY FRAMES, LOGEND, SYNC
+    { 5, &AirinServer::processSync }               // CmdSync
+};
 
-                if (client->apiLevel() < 2) // read-only is implemented in level 2
-                {
-                    client->sendMessage("FAIL 299 #Read-only mode requires API level 2");
-                    logAdmin(QString("Somebody (%1 / %2) tries to use too high-leveled command").arg(client->remoteAddress()).arg(client->hash()));
-                    return;
-                }
+void AirinServer::processClientCommand(AirinClient *client, QString command, QString room)
+{
+    AirinFrame frame(command);
+    if (frame.argc() == 0 && !frame.hasPayload())
+        return;
 
-                log ("Client decided to be in read-only mode. It will only be able to read chat.");
-                client->setReadonly(true);
-                client->sendMessage("AUTH READONLY #You are in Read-Only mode");
-                return;
-            }
+    if (frame.name().isEmpty())
+    {
+        client->sendMessage("FAIL 299 #Lol wut");
+        return;
+    }
 
-        if (useXAuth)
-        {
-            client->setInternalToken(commands[1]);
-            QString cachedUserId = AirinDatabase::db->getUserId(client->internalToken());
+    const CommandHandler &entry = commandTable[frame.command()];
 
-            if (!cachedUserId.isEmpty() && cachedUserId != "0")
-            {
-                log (QString("Client [%1:%2] passed auth process. Checking for banned status...")
-                     .arg(clients.indexOf(client)).arg(client->hash()));
+    if (entry.handler != NULL && client->apiLevel() >= entry.minApiLevel
+            && (this->*entry.handler)(client, frame, room))
+        return;
 
-                client->setExternalId(cachedUserId);
+    // Same answers as always: level 3+ clients get nothing for unknown commands
+    if (client->apiLevel() < 3)
+        client->sendMessage(QString("FAIL 299 #Unknown command or not implemented in your API level (needs level %1)")
+                            .arg(qMax((uint)2, client->apiLevel() + 1)));
+}
 
-                // This may conflict with the regex that checks usernames.
-                // But we'll assume that web-frontend that usually
-                // uses the SNS data will give us correct
-                // names. Users still won't be able to write mess there.
-                if (useMiscInfoAsName)
-                {
-                    QString miUserName = AirinDatabase::db->getMiscInfo(cachedUserId);
-                    if (!miUserName.isEmpty())
-                    {
-                        miUserName = miUserName.replace(QRegExp("\\s"), ""); // spaces are special for us
-                        client->setChatName(miUserName);
-                    }
-                }
+bool AirinServer::processRoomScope(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    Q_UNUSED(room)
 
-                AirinBanState isBanned = AirinDatabase::db->isUserBanned(client->externalId());
+    if (client->apiLevel() < AIRIN_ROOMS_API_LEVEL)
+    {
+        client->sendMessage(QString("FAIL 299 #Rooms require API level %1").arg(AIRIN_ROOMS_API_LEVEL));
+        return true;
+    }
 
-                switch (isBanned)
-                {
-                    case BAN_NONE :
-                        log ("Client isn't banned, accepting his authentication.");
-                        client->sendMessage("AUTH OK #You are welcome! :3");
-                        client->setAuthorized(true);
-
-                        logAdmin(QString("A new client connected and authorized, login %1, app %2")
-                                        .arg(client->externalId()).arg(client->app()),
-                                 LL_INFO);
-                        break;
-
-                    case BAN_SHADOW :
-                        log ("Pssst, client is shadowbanned. We'll be maximally quiet! :3");
-                        client->setShadowBanned(true);
-                        client->sendMessage("AUTH OK #You are welcome.");
-                        client->setAuthorized(true);
-
-                        logAdmin(QString("A new client connected and shadowbanned, login %1, app %2")
-                                        .arg(client->externalId()).arg(client->app()),
-                                 LL_INFO);
-
-                        break;
-
-                    case BAN_FULL :
-                        log ("Client is banned, declining him.");
-                        logAdmin(QString("A banned client tried to connect, login %1, app %2")
-                                        .arg(client->externalId()).arg(client->app()),
-                                 LL_INFO);
-
-                        client->sendMessage("AUTH BANNED #Sorry but your account is not allowed to be used with this chat.");
-                        client->close();
-
-                        break;
-                }
+    if (frame.argc() < 3 || frame.arg(2) == QLatin1String("IN"))
+    {
+        client->sendMessage("FAIL 299 #Syntax error");
+        return true;
+    }
 
-                if (client->apiLevel() < AIRIN_MIN_API_LEVEL)
-                    AirinCommands::sendClientResponse(client, deprecationMessage, AirinCommands::UCR_WARNING);
-            }
-            else
-            {
-                log (QString("Client [%1:%2] has no internal token, not authenticated!")
-                     .arg(clients.indexOf(client)).arg(client->hash()));
-                client->sendMessage("AUTH FAIL #Your auth key is invalid ._.");
-            }
-        }
-        else
-        {
-            log ("Authenticated client unconditionally as xauth module is not enabled.", LL_INFO);
-            client->setAuthorized(true);
-            client->sendMessage("AUTH OK #Airin does not require auth :3");
-        }
-        return;
-     }
+    QString scope = frame.arg(1).toString();
 
-    if (mainCmd == "LEVEL")
+    if (!clients.isInRoom(client, scope))
     {
-        bool levelOk;
-        uint level = commands.at(1).toUInt(&levelOk);
+        client->sendMessage(QString("FAIL 209 %1 #You are not in this room").arg(scope));
+        return true;
+    }
 
-        if (!levelOk || level <= 0 || level > AIRIN_MAX_API_LEVEL)
-        {
-            client->sendMessage(QString("FAIL 299 #Bad API level is set, current level is %1").arg(AIRIN_MAX_API_LEVEL));
-            return;
-        }
-        else
-        {
-            if (level > client->apiLevel())
-            {
-                client->setApiLevel(level);
-                client->sendMessage(QString("LEVEL %1 OK #Level-Up! :3").arg(level));
+    processClientCommand(client, frame.from(2).toString().trimmed(), scope);
+    return true;
+}
 
-                if (level >= 3) // initialize additional client capabilities at level 3
-                {
-                    if (clientPingMissTolerance > 0 && clientPingPollInterval > 0)
-                    {
-                            log (QString ("Setting ping interval (%1 ms) and miss tolerance (%2 ms)...")
-                                 .arg(clientPingPollInterval)
-                                 .arg(clientPingMissTolerance));
+bool AirinServer::processConnect(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    Q_UNUSED(room)
 
-                            client->setPingTimeout(clientPingPollInterval, clientPingMissTolerance);
-                    }
-                }
-            }
-        }
-    }
+    if (client->isAuthorized() && !client->isReadonly())
+        return false;
 
-    if (mainCmd == "CONTENT" && checkAuth(client))
+    if (frame.argc() < 2 || !frame.hasPayload())
     {
-        if (commands.count() < 3 || !chkString(command))
-        {
-            log ("Client tries to send inappropriate data, declining.", LL_WARNING);
-            logAdmin(QString("Somebody (%1 / %2) mismatches the protocol!").arg(client->remoteAddress()).arg(client->hash()), LL_WARNING);
+        log ("Bad client/auth information. Disconnecting", LL_WARNING);
+        client->sendMessage("FAIL 299 #Syntax error");
+        client->close();
 
-            client->sendMessage("FAIL 299 #Syntax error");
-            client->close();
-            return;
-        }
-
-        processMessage(client, commands[1], command.mid(command.indexOf("#")+1));
-        return;
+        logAdmin(QString("Somebody (%1 / %2) mismatches the protocol!").arg(client->remoteAddress()).arg(client->hash()), LL_WARNING);
+        return true;
     }
 
-    if (mainCmd == "IAM" && checkAuth(client) && !forceDefaultName)
+    QString app = frame.payload().toString();
+
+    if (app.length() > 256)
     {
-        if (commands.count() < 2 || !chkString(command))
-        {
-            log ("Client tries to set strange name, declining.", LL_WARNING);
-            client->sendMessage("FAIL 299 #Syntax error");
-            client->close();
-            return;
-        }
+        log ("Client tries to set too long app name, reducing");
+        app = app.mid(0, 253)+"...";
+    }
+
+    client->setApplication(app);
+
+    log(QString ("Client %1:%2 uses %3").arg(clients.handle(client))
+        .arg(client->hash()).arg(client->app()));
 
-        QString clName = command.mid(command.indexOf("#")+1).trimmed();
-        if (QRegExp(QString("^[a-z0-9а-яА-ЯЁё]{1,%1}$").arg(maxNameLen),
-                    Qt::CaseInsensitive).exactMatch(clName))
+
+        if (frame.arg(1) == QLatin1String("READONLY"))
         {
-            if (checkNamesDistinctness && !isNameDistinct(client))
+            if (!readonlyAllowed)
             {
-                client->sendMessage("FAIL 207 #Name is not unique, please choose another.");
-                return;
+                client->sendMessage("FAIL 299 #Read-only mode is not allowed in server configuration.");
+                return true;
             }
 
-            client->setChatName(clName);
-            client->sendMessage("NTM #"+clName);
+            if (client->apiLevel() < 2) // read-only is implemented in level 2
+            {
+                client->sendMessage("FAIL 299 #Read-only mode requires API level 2");
+                logAdmin(QString("Somebody (%1 / %2) tries to use too high-leveled command").arg(client->remoteAddress()).arg(client->hash()));
+                return true;
+            }
 
-            logAdmin(QString("Client with login %1 sets name to %2")
-                            .arg(client->externalId()).arg(clName));
-        }
-        else
-        {
-            client->setChatName(defaultUserName);
-            if (!clName.isEmpty())
-                client->sendMessage("FAIL 203 #Name should not contain anything excepting latin symbols and numbers. No spaces plz.");
-            else
-                client->sendMessage("NTM #");
+            log ("Client decided to be in read-only mode. It will only be able to read chat.");
+            client->setReadonly(true);
+            client->sendMessage("AUTH READONLY #You are in Read-Only mode");
+            return true;
         }
 
-        return;
-    }
-
-    if (mainCmd == "LOG" && (client->isReadonly() || checkAuth(client)))
+    if (useXAuth)
     {
+        client->setInternalToken(frame.arg(1).toString());
 
-        switch (commands.count())
+        if (!dbWorkers.isEmpty())
         {
+            // The answer comes to databaseAuthLookedUp(), sockets are served meanwhile
+            QMetaObject::invokeMethod(nextDatabaseWorker(), "lookupAuth", Qt::QueuedConnection,
+                                      Q_ARG(quint64, clients.handle(client)),
+                                      Q_ARG(QString, client->internalToken()),
+                                      Q_ARG(bool, useMiscInfoAsName));
+        }
+        else
+            finishAuth(client, AirinDatabase::db->lookupAuth(client->internalToken(), useMiscInfoAsName));
+    }
+    else
+    {
+        log ("Authenticated client unconditionally as xauth module is not enabled.", LL_INFO);
+        client->setAuthorized(true);
+        client->sendMessage("AUTH OK #Airin does not require auth :3");
+    }
 
-            case 1 :
-                processMessageAPI(client, 0);
-                break;
-
-            case 2 :
-                processMessageAPI(client, commands[1]);
-                break;
-
-            case 3 :
-                if (commands[2] == "DESC")
-                    processMessageAPI(client, commands[1], 0, LogDescend);
-                    else
-                if (commands[2] == "ASC")
-                    processMessageAPI(client, commands[1], 0, LogAscend);
-                else
-                    processMessageAPI(client, commands[1], commands[2]);
-                break;
+    return true;
+}
 
-            case 4 :
-                if (commands[3] == "DESC")
-                    processMessageAPI(client, commands[1], commands[2], LogDescend);
-                    else
-                if (commands[3] == "ASC")
-                    processMessageAPI(client, commands[1], commands[2], LogAscend);
-                else
-                    processMessageAPI(client, commands[1], commands[2]);
-                break;
+bool AirinServer::processLevel(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    Q_UNUSED(room)
 
-            default :
-                log ("Client tries to use message API wrong, declining.", LL_WARNING);
-                logAdmin(QString("Somebody (%1 / %2) mismatches the protocol!")
-                         .arg(client->remoteAddress()).arg(client->hash()), LL_WARNING);
-                client->sendMessage("FAIL 299 #Syntax error");
-                client->close();
-                return;
-                break;
-        }
+    bool levelOk;
+    uint level = frame.arg(1).toUInt(&levelOk);
 
-        return;
+    if (!levelOk || level <= 0 || level > AIRIN_MAX_API_LEVEL)
+    {
+        client->sendMessage(QString("FAIL 299 #Bad API level is set, current level is %1").arg(AIRIN_MAX_API_LEVEL));
+        return true;
     }
-
-    if ((mainCmd == "LOGOFF" || mainCmd == "DOWNGRADE") && checkAuth(client))
+    else
     {
-        if (commands.count() < 2)
+        if (level > client->apiLevel())
         {
-            log ("Client tries to disconnect incorrectly, declining.", LL_WARNING);
-            client->sendMessage("FAIL 299 #Syntax error");
-            client->close();
-            return;
-        }
+            client->setApiLevel(level);
+            client->sendMessage(QString("LEVEL %1 OK #Level-Up! :3").arg(level));
 
-        log (QString("Client [%1:%2] changes its auth state.")
-             .arg(clients.indexOf(client)).arg(client->hash()));
-
-        if (mainCmd == "LOGOFF")
-        {
-            if (AirinDatabase::db->killAuthSession(commands[1]))
+            if (level >= 3) // initialize additional client capabilities at level 3
             {
-                client->sendMessage(QString("LOGOFF OK #Bye ._.").arg(mainCmd));
-            }
-            else
-            {
-                client->sendMessage("LOGOFF FAIL #I can't kill this session");
-            }
+                if (clientPingMissTolerance > 0 && clientPingPollInterval > 0)
+                {
+                        log (QString ("Setting ping interval (%1 ms) and miss tolerance (%2 ms)...")
+                             .arg(clientPingPollInterval)
+                             .arg(clientPingMissTolerance));
 
-            client->close();
+                        client->setPingTimeout(clientPingPollInterval, clientPingMissTolerance);
+                }
+            }
         }
 
-        if (mainCmd == "DOWNGRADE")
+        // LEVEL 5 BINARY: chat lines come as binary records from now on, see AirinBinaryFrame
+        if (frame.arg(2) == QLatin1String("BINARY"))
         {
-            if (client->apiLevel() < 2)
-            {
-                client->sendMessage("FAIL 299 #You should have API level 2 to use this.");
-                return;
-            }
-
-            if (readonlyAllowed)
-            {
-                client->setReadonly(true);
-                client->sendMessage(QString("DOWNGRADE OK #You're read-only now").arg(mainCmd));
-            }
+            if (client->apiLevel() < AIRIN_BINARY_API_LEVEL)
+                client->sendMessage(QString("FAIL 299 #Binary protocol needs API level %1").arg(AIRIN_BINARY_API_LEVEL));
             else
             {
-                client->sendMessage("FAIL 299 #Read-only mode is not allowed by server configuration");
+                // zlib would only get in the way of records that short
+                client->setCompression(0);
+                client->setBinaryProtocol(true);
+                client->sendMessage("BINARY ON #CONTENT and LOGCON go as binary records");
             }
         }
-        return;
     }
 
-    /// LEVEL 2 : COMMANDS + REPORTS SUPPORT
+    return true;
+}
 
-    if (client->apiLevel() < 2)
-    {
-        client->sendMessage("FAIL 299 #Unknown command or not implemented in your API level (needs level 2)");
-        return;
+bool AirinServer::processContent(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    if (!checkAuth(client))
+        return false;
+
+    if (frame.argc() < 2 || !frame.hasPayload())
+    {
+        log ("Client tries to send inappropriate data, declining.", LL_WARNING);
+        logAdmin(QString("Somebody (%1 / %2) mismatches the protocol!").arg(client->remoteAddress()).arg(client->hash()), LL_WARNING);
+
+        client->sendMessage("FAIL 299 #Syntax error");
+        client->close();
+        return true;
     }
 
-    // There were some functions that are specific to provoda.ch
-    // So this level is useless in open source version of Airin.
-    // Switch to 3rd level instead.
+    processMessage(client, frame.arg(1).toString(), frame.payload().toString(), room);
+    return true;
+}
 
-    /// LEVEL 3 : MESSAGE REMOVAL, REMOTE PARAMETERS, RESTART, SUS
+bool AirinServer::processIam(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    Q_UNUSED(room)
 
-    if (client->apiLevel() < 3)
+    if (!checkAuth(client) || forceDefaultName)
+        return false;
+
+    if (!frame.hasPayload())
     {
-        client->sendMessage("FAIL 299 #Unknown command or not implemented in your API level (needs level 3)");
-        return;
+        log ("Client tries to set strange name, declining.", LL_WARNING);
+        client->sendMessage("FAIL 299 #Syntax error");
+        client->close();
+        return true;
     }
 
-    if (mainCmd == "GETSET")
+    QString clName = frame.payload().trimmed().toString();
+    if (QRegExp(QString("^[a-z0-9а-яА-ЯЁё]{1,%1}$").arg(maxNameLen),
+                Qt::CaseInsensitive).exactMatch(clName))
     {
-        client->sendMessage(QString("SET nick_regex #^[a-z0-9а-яА-ЯЁё]{1,%1}$").arg(maxNameLen));
-        client->sendMessage(QString("SET max_name_length #%1").arg(maxNameLen));
-        client->sendMessage(QString("SET max_message_length #%1").arg(maxMessageLen));
-        client->sendMessage(QString("SET min_message_delay #%1").arg(minMessageDelay));
-        client->sendMessage(QString("SET max_log_message_amount #%1").arg(maxMessageAmount));
-        client->sendMessage(QString("SET color_reset_attempts #%1").arg(colorResetMax));
-        client->sendMessage(QString("SET logins_disclosed #%1").arg(discloseUserIds ? "1" : "0"));
+        if (checkNamesDistinctness && !isNameDistinct(client))
+        {
+            client->sendMessage("FAIL 207 #Name is not unique, please choose another.");
+            return true;
+        }
 
-        return;
+        client->setChatName(clName);
+        client->sendMessage("NTM #"+clName);
+
+        logAdmin(QString("Client with login %1 sets name to %2")
+                        .arg(client->externalId()).arg(clName));
     }
+    else
+    {
+        client->setChatName(defaultUserName);
+        if (!clName.isEmpty())
+            client->sendMessage("FAIL 203 #Name should not contain anything excepting latin symbols and numbers. No spaces plz.");
+        else
+            client->sendMessage("NTM #");
+    }
+
+    return true;
+}
 
-    if (mainCmd == "SUS")
+bool AirinServer::processLog(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    if (!client->isReadonly() && !checkAuth(client))
+        return false;
+
+    if (frame.arg(1) == QLatin1String("BEFORE") || frame.arg(1) == QLatin1String("AFTER"))
     {
-        client->resetPingMisses();
-        return;
+        if (frame.argc() != 4)
+        {
+            client->sendMessage("FAIL 299 #Syntax error, use LOG <BEFORE|AFTER> <id> <amount>");
+            return true;
+        }
+
+        processLogCursor(client, frame.arg(1).toString(), frame.arg(2).toString(), frame.arg(3).toString(), room);
+        return true;
     }
 
+    switch (frame.argc())
+    {
+
+        case 1 :
+            processMessageAPI(client, 0, 0, LogAscend, room);
+            break;
+
+        case 2 :
+            processMessageAPI(client, frame.arg(1).toString(), 0, LogAscend, room);
+            break;
+
+        case 3 :
+            if (frame.arg(2) == QLatin1String("DESC"))
+                processMessageAPI(client, frame.arg(1).toString(), 0, LogDescend, room);
+                else
+            if (frame.arg(2) == QLatin1String("ASC"))
+                processMessageAPI(client, frame.arg(1).toString(), 0, LogAscend, room);
+            else
+                processMessageAPI(client, frame.arg(1).toString(), frame.arg(2).toString(), LogAscend, room);
+            break;
 
+        case 4 :
+            if (frame.arg(3) == QLatin1String("DESC"))
+                processMessageAPI(client, frame.arg(1).toString(), frame.arg(2).toString(), LogDescend, room);
+            else
+                processMessageAPI(client, frame.arg(1).toString(), frame.arg(2).toString(), LogAscend, room);
+            break;
+
+        default :
+            log ("Client tries to use message API wrong, declining.", LL_WARNING);
+            logAdmin(QString("Somebody (%1 / %2) mismatches the protocol!")
+                     .arg(client->remoteAddress()).arg(client->hash()), LL_WARNING);
+            client->sendMessage("FAIL 299 #Syntax error");
+            client->close();
+            break;
+    }
+
+    return true;
 }
 
-void AirinServer::processMessage(AirinClient *client, QString recCode, QString message)
+bool AirinServer::processSync(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    if (!client->isReadonly() && !checkAuth(client))
+        return false;
+
+    bool idOk;
+    int lastSeen = frame.arg(1).toInt(&idOk);
+
+    if (frame.argc() != 2 || !idOk || lastSeen < 0)
+    {
+        client->sendMessage("FAIL 299 #Syntax error, use SYNC <last seen id>");
+        return true;
+    }
+
+    AirinLogRequest req;
+    req.amount = maxMessageAmount + 1; // one more tells that the gap is too large
+    req.from = lastSeen + 1;
+    req.order = LogAscend;
+    req.cursor = LogWindow;
+    req.room = room;
+    req.client = client;
+    req.clientHandle = clients.handle(client);
+
+    // Only the memory is asked, if it can't tell everything the client has to reload anyway.
+    // A room that is not in the buffer yet is a gap too, SYNC never goes to SQL
+    QList<int> removed;
+    QList<AirinMessage> *messages = (history.isSeeded(room) && history.removedSince(&removed, lastSeen, room))
+            ? historyMessages(req) : NULL;
+
+    if (messages == NULL || (uint)messages->count() > maxMessageAmount)
+    {
+        log (QString("Client missed too much since %1 to sync, it has to reload").arg(lastSeen));
+        client->sendMessage(roomFrame(room, QString("SYNC GAP %1 #Too much was missed, reload with LOG").arg(lastSeen)));
+
+        delete messages;
+        return true;
+    }
+
+    // SYNC OK <new messages> <removed messages> closes the list, LOGEND follows as usual
+    QStringList tail;
+    for (int i = 0; i < removed.count(); i++)
+        tail.append(roomFrame(room, QString("REMCON %1 #Remove me plz").arg(removed.at(i))));
+
+    tail.append(roomFrame(room, QString("SYNC OK %1 %2 #").arg(messages->count()).arg(removed.count())));
+
+    log (QString("Syncing client since %1: %2 new, %3 removed").arg(lastSeen).arg(messages->count()).arg(removed.count()));
+    sendLogMessages(req, messages, tail);
+
+    delete messages;
+    return true;
+}
+
+bool AirinServer::processAuthChange(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    Q_UNUSED(room)
+
+    if (!checkAuth(client))
+        return false;
+
+    if (frame.argc() < 2 && !frame.hasPayload())
+    {
+        log ("Client tries to disconnect incorrectly, declining.", LL_WARNING);
+        client->sendMessage("FAIL 299 #Syntax error");
+        client->close();
+        return true;
+    }
+
+    log (QString("Client [%1:%2] changes its auth state.")
+         .arg(clients.handle(client)).arg(client->hash()));
+
+    if (frame.command() == AirinFrame::CmdLogoff)
+    {
+        if (AirinDatabase::db->killAuthSession(frame.arg(1).toString()))
+        {
+            client->sendMessage("LOGOFF OK #Bye ._.");
+        }
+        else
+        {
+            client->sendMessage("LOGOFF FAIL #I can't kill this session");
+        }
+
+        client->close();
+    }
+    else
+    {
+        if (client->apiLevel() < 2)
+        {
+            client->sendMessage("FAIL 299 #You should have API level 2 to use this.");
+            return true;
+        }
+
+        if (readonlyAllowed)
+        {
+            client->setReadonly(true);
+            client->sendMessage("DOWNGRADE OK #You're read-only now");
+        }
+        else
+        {
+            client->sendMessage("FAIL 299 #Read-only mode is not allowed by server configuration");
+        }
+    }
+
+    return true;
+}
+
+bool AirinServer::processGetset(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    Q_UNUSED(frame)
+    Q_UNUSED(room)
+
+    client->sendMessage(QString("SET nick_regex #^[a-z0-9а-яА-ЯЁё]{1,%1}$").arg(maxNameLen));
+    client->sendMessage(QString("SET max_name_length #%1").arg(maxNameLen));
+    client->sendMessage(QString("SET max_message_length #%1").arg(maxMessageLen));
+    client->sendMessage(QString("SET min_message_delay #%1").arg(minMessageDelay));
+    client->sendMessage(QString("SET max_log_message_amount #%1").arg(maxMessageAmount));
+    client->sendMessage(QString("SET color_reset_attempts #%1").arg(colorResetMax));
+    client->sendMessage(QString("SET logins_disclosed #%1").arg(discloseUserIds ? "1" : "0"));
+
+    if (client->apiLevel() >= AIRIN_BATCH_API_LEVEL)
+        client->sendMessage(QString("SET content_batch_window #%1").arg(contentBatchWindow));
+
+    return true;
+}
+
+bool AirinServer::processSus(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    Q_UNUSED(frame)
+    Q_UNUSED(room)
+
+    client->resetPingMisses();
+    return true;
+}
+
+bool AirinServer::processCompress(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    Q_UNUSED(room)
+
+    if (!useCompression)
+    {
+        client->sendMessage("FAIL 299 #Compression is not allowed by server configuration");
+        return true;
+    }
+
+    if (client->isBinaryProtocol())
+    {
+        client->sendMessage("FAIL 299 #Compression can't be used together with the binary protocol");
+        return true;
+    }
+
+    if (frame.arg(1) == QLatin1String("OFF"))
+    {
+        client->setCompression(0);
+        client->sendMessage("COMPRESS OFF #Text frames only");
+    }
+    else
+    {
+        // Frames longer than this are sent as binary messages made by qCompress()
+        client->setCompression(compressionMinSize);
+        client->sendMessage(QString("COMPRESS ON %1 #zlib").arg(compressionMinSize));
+    }
+
+    return true;
+}
+
+bool AirinServer::processRoomChange(AirinClient *client, const AirinFrame &frame, const QString &room)
+{
+    Q_UNUSED(room)
+
+    QString target = frame.arg(1).toString();
+
+    if (!QRegExp("^[a-z0-9_-]{1,32}$").exactMatch(target))
+    {
+        client->sendMessage("FAIL 299 #Room name should be 1 to 32 latin symbols, numbers, - or _");
+        return true;
+    }
+
+    if (frame.command() == AirinFrame::CmdJoin)
+    {
+        if ((uint)clients.rooms(client).count() >= maxRoomsPerClient)
+        {
+            client->sendMessage(QString("FAIL 209 %1 #You can't be in more than %2 rooms")
+                                .arg(target).arg(maxRoomsPerClient));
+            return true;
+        }
+
+        clients.join(client, target);
+        client->sendMessage(QString("JOIN %1 OK #Welcome to the room").arg(target));
+    }
+    else
+    {
+        clients.part(client, target);
+        client->sendMessage(QString("PART %1 OK #Bye").arg(target));
+    }
+
+    log (QString("Client [%1:%2] is in rooms: %3")
+         .arg(clients.handle(client)).arg(client->hash()).arg(clients.rooms(client).join(", ")));
+    return true;
+}
+
+void AirinServer::finishAuth(AirinClient *client, const AirinAuthResult &auth)
+{
+    if (!auth.userId.isEmpty() && auth.userId != "0")
+    {
+        log (QString("Client [%1:%2] passed auth process. Checking for banned status...")
+             .arg(clients.handle(client)).arg(client->hash()));
+
+        client->setExternalId(auth.userId);
+        clients.reindex(client);
+
+        // This may conflict with the regex that checks usernames.
+        // But we'll assume that web-frontend that usually
+        // uses the SNS data will give us correct
+        // names. Users still won't be able to write mess there.
+        if (useMiscInfoAsName)
+        {
+            QString miUserName = auth.miscInfo;
+            if (!miUserName.isEmpty())
+            {
+                miUserName = miUserName.replace(QRegExp("\\s"), ""); // spaces are special for us
+                client->setChatName(miUserName);
+            }
+        }
+
+        switch (auth.banState)
+        {
+            case BAN_NONE :
+                log ("Client isn't banned, accepting his authentication.");
+                client->sendMessage("AUTH OK #You are welcome! :3");
+                client->setAuthorized(true);
+
+                logAdmin(QString("A new client connected and authorized, login %1, app %2")
+                                .arg(client->externalId()).arg(client->app()),
+                         LL_INFO);
+                break;
+
+            case BAN_SHADOW :
+                log ("Pssst, client is shadowbanned. We'll be maximally quiet! :3");
+                client->setShadowBanned(true);
+                client->sendMessage("AUTH OK #You are welcome.");
+                client->setAuthorized(true);
+
+                logAdmin(QString("A new client connected and shadowbanned, login %1, app %2")
+                                .arg(client->externalId()).arg(client->app()),
+                         LL_INFO);
+
+                break;
+
+            case BAN_FULL :
+                log ("Client is banned, declining him.");
+                logAdmin(QString("A banned client tried to connect, login %1, app %2")
+                                .arg(client->externalId()).arg(client->app()),
+                         LL_INFO);
+
+                client->sendMessage("AUTH BANNED #Sorry but your account is not allowed to be used with this chat.");
+                client->close();
+
+                break;
+        }
+
+        if (client->apiLevel() < AIRIN_MIN_API_LEVEL)
+            AirinCommands::sendClientResponse(client, deprecationMessage, AirinCommands::UCR_WARNING);
+    }
+    else
+    {
+        log (QString("Client [%1:%2] has no internal token, not authenticated!")
+             .arg(clients.handle(client)).arg(client->hash()));
+        client->sendMessage("AUTH FAIL #Your auth key is invalid ._.");
+    }
+}
+
+void AirinServer::databaseAuthLookedUp(quint64 clientHandle, AirinAuthResult result)
+{
+    AirinClient *client = clients.byHandle(clientHandle);
+    if (client == NULL)
+    {
+        log ("Client has gone before its auth lookup finished");
+        return;
+    }
+
+    finishAuth(client, result);
+}
+
+void AirinServer::processMessage(AirinClient *client, QString recCode, QString message, QString room)
 {
     uint lastTime = lastMessageTime.value(client->externalId(), 0),
          now = QDateTime::currentDateTime().toTime_t();
@@ -748,7 +1298,7 @@ void AirinServer::processMessage(AirinClient *client, QString recCode, QString m
             if (AirinCommands::process(cmd, client, this))
             {
                 log (QString("Client [%1:%2] sent a command instead of a message, won't even save it.")
-                     .arg(clients.indexOf(client)).arg(client->hash()));
+                     .arg(clients.handle(client)).arg(client->hash()));
                 client->sendMessage("CONREC "+recCode+" 0");
                 return;
             }
@@ -763,177 +1313,700 @@ void AirinServer::processMessage(AirinClient *client, QString recCode, QString m
         }
         else
         {
-            int messageId = 0;
+            AirinMessage posted;
+            posted.id = 0;
+            posted.visible = !client->isShadowBanned();
+            posted.name = client->chatName();
+            posted.message = message;
+            posted.color = client->chatColor();
+            posted.login = client->externalId();
+            posted.room = room;
+            posted.timestamp = QDateTime::currentDateTime();
 
             if (useXAuth)
             {
-                messageId = AirinDatabase::db->addMessage(client->externalId(), message,
-                                                              client->chatName(), client->chatColor(),
-                                                              !client->isShadowBanned());
-                if (messageId > -1)
+                if (messageWriter != NULL)
                 {
-                    log ("Message saved successfully with id "+QString::number(messageId));
+                    // The ID is ours right now, the message itself will be saved a bit later.
+                    // CONREC confirms that the message is accepted, not that it is on disk.
+                    posted.id = AirinDatabase::db->reserveMessageId();
+
+                    if (posted.id > 0)
+                        messageWriter->enqueue(posted);
                 }
-                    else
+                else
                 {
-                    client->sendMessage("FAIL 299 #Internal Airin error");
-                    log ("Could not save message! Fcuk!", LL_WARNING);
-                    logAdmin("WARNING! Database error, see system logs!", LL_WARNING);
+#ifdef AIRIN_LIBPQ
+                    if (pgPipeline != NULL)
+                    {
+                        quint64 ticket = pgPipeline->addMessage(posted);
+
+                        if (ticket > 0)
+                        {
+                            // The rest is done by pipelineMessageAdded() when the ID comes back
+                            AirinPendingPost post;
+                            post.clientHandle = clients.handle(client);
+                            post.recCode = recCode;
+                            post.message = posted;
+
+                            pipelinePosts.insert(ticket, post);
+                            return;
+                        }
+                    }
+#endif
+                    posted.id = AirinDatabase::db->addMessage(posted.login, posted.message, posted.name,
+                                                              posted.color, posted.visible, room);
                 }
             }
 
-            client->sendMessage(QString("CONREC %1 %2").arg(recCode).arg(messageId));
+            deliverMessage(client, recCode, posted);
+        }
+    }
+        else
+    {
+        log (QString("Client %1 tries to send messages too fastly! GOLAKTEKO OPASNOSTE!")
+             .arg(client->externalId()));
+
+        logAdmin(QString("Client %1 (%2) floods the chat, oh shit!")
+                        .arg(client->chatName()).arg(client->externalId()), LL_WARNING);
+
+        client->sendMessage(QString("FAIL 205 %1 #Don't flood! Message frequency is limited to %1 seconds.")
+                            .arg(minMessageDelay));
+        if (delayTroll)
+        {
+            log ("Delay trolling is enabled! Users will be blocked until they'll wait the delay limit.");
+            lastMessageTime[client->externalId()] = now;
+        }
+
+    }
+}
+
+void AirinServer::deliverMessage(AirinClient *client, QString recCode, AirinMessage posted)
+{
+    // The client may be gone already if the message was saved asynchronously
+    if (useXAuth)
+    {
+        if (posted.id > -1)
+        {
+            log ("Message saved successfully with id "+QString::number(posted.id));
+            history.append(posted);
+        }
+            else
+        {
+            if (client != NULL)
+                client->sendMessage("FAIL 299 #Internal Airin error");
+
+            log ("Could not save message! Fcuk!", LL_WARNING);
+            logAdmin("WARNING! Database error, see system logs!", LL_WARNING);
+        }
+    }
+
+    if (client != NULL)
+        client->sendMessage(QString("CONREC %1 %2").arg(recCode).arg(posted.id));
+
+    // Messages should be sent independently on database
+    QString messageCommand = QString("CONTENT %1 %2 %3 %4 %5 #%6")
+            .arg((posted.id > 0) ? posted.id : 0)
+            .arg(posted.timestamp.toTime_t())
+            .arg(posted.name)
+            .arg(posted.color)
+            .arg(discloseUserIds ? posted.login : "null")
+            .arg(posted.message);
+
+
+    // Hidden messages change nothing for the others, but their author's answers can't be shared anymore
+    if (posted.visible)
+        logCache.invalidate(posted.room);
+    else
+        hiddenAuthors.insert(posted.login);
+
+    QByteArray messageBinary;
+    appendBinaryRecord(&messageBinary, AirinBinaryFrame::RecordContent, posted);
+
+    // Shadowban: message will be visible ONLY for client if it is shadowbanned
+    if (!posted.visible)
+    {
+        AirinBroadcast payload(roomFrame(posted.room, messageCommand));
+        payload.authorizedOnly = false;
+        payload.room = posted.room;
+        payload.binary = messageBinary;
+        payload.droppable = true;
+
+        broadcast(payload, posted.login);
+    }
+    else
+        contentBroadcast(messageCommand, posted.room, messageBinary);
+}
+
+void AirinServer::processMessageAPI(AirinClient *client, QString messageAmount,
+                                    QString messageOffset, LogOrder order, QString room)
+{
+    bool valueCorrect;
+    uint amount = messageAmount.toInt(&valueCorrect);
+
+    if (!valueCorrect || amount <= 0 || amount > maxMessageAmount)
+    {
+        client->sendMessage("FAIL 299 #Bad amount parameter");
+        return;
+    }
+
+    uint offset = messageOffset.toInt(&valueCorrect);
+
+    if (!valueCorrect || offset <= 0 || offset >= AirinDatabase::db->lastMessage())
+    {
+        log (QString("Client requested no or wrong offset, will send last %1 messages.").arg(amount));
+        offset = -1;
+    }
+
+    AirinLogRequest req;
+    req.amount = amount;
+    req.from = offset;
+    req.order = order;
+    req.cursor = LogWindow;
+    req.room = room;
+    req.client = client;
+    req.clientHandle = clients.handle(client);
+
+
+    if (useLogRequestQueue)
+        enqueueLogRequest(req);
+    else
+        respondLogRequest(req);
+
+}
+
+void AirinServer::processLogCursor(AirinClient *client, QString direction, QString cursorId,
+                                   QString messageAmount, QString room)
+{
+    if (client->apiLevel() < AIRIN_CURSOR_API_LEVEL)
+    {
+        client->sendMessage(QString("FAIL 299 #LOG cursors require API level %1").arg(AIRIN_CURSOR_API_LEVEL));
+        return;
+    }
+
+    bool valueCorrect;
+    uint amount = messageAmount.toUInt(&valueCorrect);
+
+    if (!valueCorrect || amount <= 0 || amount > maxMessageAmount)
+    {
+        client->sendMessage("FAIL 299 #Bad amount parameter");
+        return;
+    }
+
+    uint cursor = cursorId.toUInt(&valueCorrect);
+
+    if (!valueCorrect || cursor > INT_MAX)
+    {
+        client->sendMessage("FAIL 299 #Bad cursor, use 0 to start from the newest message");
+        return;
+    }
+
+    AirinLogRequest req;
+    req.amount = amount;
+    req.from = cursor;
+    req.order = LogAscend;
+    req.cursor = (direction == "AFTER") ? LogAfter : LogBefore;
+    req.room = room;
+    req.client = client;
+    req.clientHandle = clients.handle(client);
+
+    if (useLogRequestQueue)
+        enqueueLogRequest(req);
+    else
+        respondLogRequest(req);
+}
+
+void AirinServer::enqueueLogRequest(AirinLogRequest req)
+{
+    if (!req.client->isReady())
+        return;
+
+    switch (logScheduler.enqueue(req, req.client->externalId(), req.client->remoteAddress()))
+    {
+        case AirinLogScheduler::QueueFull :
+            req.client->sendMessage("FAIL 299 #Log request queue is full, wait plz");
+            break;
+
+        case AirinLogScheduler::AddressFull :
+            req.client->sendMessage("FAIL 299 #Too many log requests from your address, wait plz");
+            break;
+
+        default :
+            break;
+    }
+}
+
+void AirinServer::respondLogRequest(AirinLogRequest req)
+{
+    if (!resolveLogRequest(&req))
+    {
+        log ("Trying to send logs to a disconnected client, aborting");
+        return;
+    }
+
+    // Most LOG requests are the same, they share one encoded answer
+    if (req.cursor == LogWindow && isLogCacheable(req))
+    {
+        const AirinLogCacheEntry *cached = logCache.find(req);
+
+        if (cached != NULL)
+        {
+            log (QString("Served %1 messages from the LOG cache").arg(cached->messages.count()));
+            answerCachedLog(req, *cached);
+            return;
+        }
+    }
+
+    req.cacheGeneration = logCache.generation();
+
+    QList<AirinMessage> *messages = (req.cursor == LogWindow) ? historyMessages(req) : NULL;
+
+    if (messages == NULL && !dbWorkers.isEmpty())
+    {
+        // The answer comes to databaseLogFetched(), sockets are served meanwhile
+        QMetaObject::invokeMethod(nextDatabaseWorker(), "fetchLog", Qt::QueuedConnection,
+                                  Q_ARG(AirinLogRequest, req),
+                                  Q_ARG(QString, req.client->externalId()));
+        return;
+    }
+
+    if (req.cursor != LogWindow)
+    {
+        // One extra row tells if there's another page
+        messages = AirinDatabase::db->getMessagesPage(req.amount + 1, req.from, req.cursor,
+                                                      req.client->externalId(), req.room);
+
+        if (messages == NULL)
+        {
+            log ("Database returned bad messages list", LL_WARNING);
+            return;
+        }
+
+        answerLogRequest(req, messages);
+        delete messages;
+        return;
+    }
+
+    if (messages == NULL) // older than the buffer, ask the database
+    {
+        if (req.from > 0)
+        {
+            messages = AirinDatabase::db->getMessages(req.amount, req.from, req.client->externalId(), req.room);
+        }
+            else // user requested just last N messages
+        {
+            messages = AirinDatabase::db->getMessages(req.amount, 0, req.client->externalId(), req.room);
+        }
+
+        if (messages == NULL)
+        {
+            log ("Database returned bad messages list", LL_WARNING);
+            return;
+        }
+
+        if (messageWriter != NULL)
+            mergeUnsavedMessages(messages, req);
+    }
+
+    answerLogRequest(req, messages);
+    delete messages;
+}
+
+bool AirinServer::resolveLogRequest(AirinLogRequest *req)
+{
+    // Handles are never reused, so a request of a gone client can't reach
+    // another one even if it got the same address in memory
+    req->client = clients.byHandle(req->clientHandle);
+
+    // Merged requests are of the same user, any of them may ask instead
+    while (req->client == NULL && !req->followers.isEmpty())
+    {
+        req->clientHandle = req->followers.takeFirst();
+        req->client = clients.byHandle(req->clientHandle);
+    }
+
+    return req->client != NULL;
+}
+
+void AirinServer::answerLogRequest(const AirinLogRequest &req, QList<AirinMessage> *messages)
+{
+    // Nothing changed in the room while it was prepared, so it's good for everyone who asks the same
+    if (req.cursor == LogWindow && isLogCacheable(req) && req.cacheGeneration == logCache.generation())
+    {
+        AirinLogCacheEntry entry;
+        entry.messages = *messages;
+
+        int msCnt = messages->count();
+        for (int n = 0; n < msCnt; n++)
+            entry.frames.append(roomFrame(req.room, logFrame(messages->at((req.order == LogDescend) ? msCnt - 1 - n : n))));
+
+        const AirinLogCacheEntry *cached = logCache.insert(req, entry);
+        answerCachedLog(req, (cached != NULL) ? *cached : entry);
+        return;
+    }
+
+    // Every merged client gets its own copy, pages are trimmed in place
+    for (int i = -1; i < req.followers.count(); i++)
+    {
+        AirinLogRequest one = req;
+        one.followers.clear();
+
+        if (i >= 0)
+        {
+            one.clientHandle = req.followers.at(i);
+            one.client = clients.byHandle(one.clientHandle);
+
+            if (one.client == NULL)
+                continue;
+        }
+
+        QList<AirinMessage> answer = *messages;
+
+        if (one.cursor != LogWindow)
+            sendLogPage(one, &answer);
+        else
+            sendLogMessages(one, &answer);
+    }
+}
+
+void AirinServer::databaseLogFetched(AirinLogRequest req, AirinMessageList messages, bool ok)
+{
+    if (!resolveLogRequest(&req))
+    {
+        log ("Logs are fetched for a client that is gone already, dropping them");
+        return;
+    }
+
+    if (!ok)
+    {
+        log ("Database returned bad messages list", LL_WARNING);
+        return;
+    }
+
+    if (req.cursor == LogWindow && messageWriter != NULL)
+        mergeUnsavedMessages(&messages, req);
+
+    answerLogRequest(req, &messages);
+}
+
+void AirinServer::sendLogMessages(const AirinLogRequest &req, QList<AirinMessage> *messages, const QStringList &tail)
+{
+    if (messages->isEmpty() && tail.isEmpty())
+        log ("There were no messages matching client's request");
+
+    AirinLogStream stream;
+    stream.room = req.room;
+    stream.order = req.order;
+    stream.messages = *messages;
+    stream.sent = 0;
+    stream.tail = tail;
+
+    queueLogStream(req.clientHandle, req.client, stream);
+}
+
+void AirinServer::queueLogStream(quint64 clientHandle, AirinClient *client, AirinLogStream &stream)
+{
+    // Short answers go right away, unless the client is still getting a previous one
+    bool busy = logStreams.contains(clientHandle);
+    if (!busy && sendLogChunk(client, stream))
+        return;
+
+    if (!busy)
+        logStreamOrder.enqueue(clientHandle);
+
+    logStreams[clientHandle].enqueue(stream);
+
+    if (logStreamTimer != NULL && !logStreamTimer->isActive())
+        logStreamTimer->start();
+}
+
+void AirinServer::answerCachedLog(const AirinLogRequest &req, const AirinLogCacheEntry &cached)
+{
+    if (cached.messages.isEmpty())
+        log ("There were no messages matching client's request");
+
+    for (int i = -1; i < req.followers.count(); i++)
+    {
+        quint64 handle = (i < 0) ? req.clientHandle : req.followers.at(i);
+        AirinClient *client = (i < 0) ? req.client : clients.byHandle(handle);
+
+        if (client == NULL)
+            continue;
+
+        // Lists are implicitly shared, nothing is copied here
+        AirinLogStream stream;
+        stream.room = req.room;
+        stream.order = req.order;
+        stream.messages = cached.messages;
+        stream.frames = cached.frames;
+        stream.sent = 0;
+
+        queueLogStream(handle, client, stream);
+    }
+}
+
+bool AirinServer::isLogCacheable(const AirinLogRequest &req)
+{
+    // Clients with hidden messages of their own see a different answer, it's built just for them
+    if (logCache.capacity() <= 0 || !hiddenAuthorsKnown || req.client->isShadowBanned())
+        return false;
+
+    return !hiddenAuthors.contains(req.client->externalId());
+}
+
+bool AirinServer::sendLogChunk(AirinClient *client, AirinLogStream &stream)
+{
+    int msCnt = stream.messages.count(); // just caching, nothing special
+    int last = (logChunkSize > 0) ? qMin(msCnt, stream.sent + (int)logChunkSize) : msCnt;
+
+    if (last > stream.sent)
+    {
+        // The whole chunk goes as one binary message, records keep the order text lines would have
+        if (client->isBinaryProtocol())
+        {
+            QByteArray records;
+
+            for (int n = stream.sent; n < last; n++)
+                appendBinaryRecord(&records, AirinBinaryFrame::RecordLog,
+                                   stream.messages.at((stream.order == LogDescend) ? msCnt - 1 - n : n));
+
+            client->sendBinary(roomFrame(stream.room, QString("LOGCON %1 records").arg(last - stream.sent)), records, true);
+        }
+        else
+        {
+            for (int n = stream.sent; n < last; n++)
+            {
+                if (!stream.frames.isEmpty())
+                    client->sendMessage(stream.frames.at(n), true);
+                else
+                    client->sendMessage(roomFrame(stream.room,
+                                                  logFrame(stream.messages.at((stream.order == LogDescend) ? msCnt - 1 - n : n))),
+                                        true);
+            }
+        }
+
+        stream.sent = last;
+    }
+
+    if (stream.sent < msCnt)
+        return false;
+
+    if (msCnt == 0 && stream.tail.isEmpty())
+        client->sendMessage(roomFrame(stream.room, "FAIL 206 #No messages"));
+
+    for (int i = 0; i < stream.tail.count(); i++)
+        client->sendMessage(stream.tail.at(i));
+
+    // LOGEND <count> : nothing more comes for this request
+    if (client->apiLevel() >= AIRIN_LOGEND_API_LEVEL)
+        client->sendMessage(roomFrame(stream.room, QString("LOGEND %1 #").arg(msCnt)));
+
+    return true;
+}
+
+QString AirinServer::logFrame(const AirinMessage &message)
+{
+    return QString("LOGCON %1 %2 %3 %4 %5 #%6")
+            .arg(message.id)
+            .arg(message.timestamp.toTime_t())
+            .arg(message.name.isEmpty() ? defaultUserName : message.name)
+            .arg(message.color.isEmpty() ? "NULL" : message.color)
+            .arg(discloseUserIds ? message.login : "null")
+            .arg(message.message);
+}
+
+void AirinServer::pumpLogStreams()
+{
+    if (logStreamOrder.isEmpty())
+        return;
+
+    quint64 handle = logStreamOrder.dequeue();
+    AirinClient *client = clients.byHandle(handle);
+
+    if (client == NULL)
+    {
+        log ("Client left before its logs were sent, dropping the rest");
+        logStreams.remove(handle);
+    }
+    else
+    {
+        QQueue<AirinLogStream> &streams = logStreams[handle];
+
+        if (sendLogChunk(client, streams.head()))
+            streams.dequeue();
+
+        if (streams.isEmpty())
+            logStreams.remove(handle);
+        else
+            logStreamOrder.enqueue(handle);
+    }
+
+    if (!logStreamOrder.isEmpty())
+        logStreamTimer->start();
+}
 
-            // Messages should be sent independently on database
-            QString messageCommand = QString("CONTENT %1 %2 %3 %4 %5 #%6")
-                    .arg((messageId > 0) ? messageId : 0)
-                    .arg(QDateTime::currentDateTime().toTime_t())
-                    .arg(client->chatName())
-                    .arg(client->chatColor())
-                    .arg(discloseUserIds ? client->externalId() : "null")
-                    .arg(message);
+void AirinServer::appendBinaryRecord(QByteArray *out, AirinBinaryFrame::RecordType type, const AirinMessage &message)
+{
+    // Same substitutions as in text frames, except that missing values are just empty
+    AirinBinaryFrame::append(out, type, message.id, message.timestamp.toTime_t(),
+                             message.room.isEmpty() ? QString(AIRIN_DEFAULT_ROOM) : message.room,
+                             message.name.isEmpty() ? defaultUserName : message.name,
+                             message.color,
+                             discloseUserIds ? message.login : QString(),
+                             message.message);
+}
 
+static bool messageIdLessThan(const AirinMessage &a, const AirinMessage &b)
+{
+    return a.id < b.id;
+}
 
-            // Shadowban: message will be visible ONLY for client if it is shadowbanned
-            if (client->isShadowBanned())
-                broadcastForXId(client->externalId(), messageCommand);
-            else
-                messageBroadcast(messageCommand);
-        }
-    }
-        else
+void AirinServer::sendLogPage(const AirinLogRequest &req, QList<AirinMessage> *messages)
+{
+    int cursor = (int)req.from;
+
+    // Not saved yet, but already seen by everyone
+    if (messageWriter != NULL)
     {
-        log (QString("Client %1 tries to send messages too fastly! GOLAKTEKO OPASNOSTE!")
-             .arg(client->externalId()));
+        QList<AirinMessage> unsaved = messageWriter->unsaved(req.room);
+        QSet<int> known;
 
-        logAdmin(QString("Client %1 (%2) floods the chat, oh shit!")
-                        .arg(client->chatName()).arg(client->externalId()), LL_WARNING);
+        for (int i = 0; i < messages->count(); i++)
+            known.insert(messages->at(i).id);
 
-        client->sendMessage(QString("FAIL 205 %1 #Don't flood! Message frequency is limited to %1 seconds.")
-                            .arg(minMessageDelay));
-        if (delayTroll)
+        for (int i = 0; i < unsaved.count(); i++)
         {
-            log ("Delay trolling is enabled! Users will be blocked until they'll wait the delay limit.");
-            lastMessageTime[client->externalId()] = now;
+            const AirinMessage &msg = unsaved.at(i);
+
+            if (known.contains(msg.id) || (!msg.visible && msg.login != req.client->externalId()))
+                continue;
+
+            if ((req.cursor == LogAfter && msg.id > cursor) ||
+                (req.cursor == LogBefore && (cursor <= 0 || msg.id < cursor)))
+                messages->append(msg);
         }
 
+        std::sort(messages->begin(), messages->end(), messageIdLessThan);
     }
-}
 
-void AirinServer::processMessageAPI(AirinClient *client, QString messageAmount,
-                                    QString messageOffset, LogOrder order)
-{
-    bool valueCorrect;
-    uint amount = messageAmount.toInt(&valueCorrect);
+    // The database gave one row more than asked, if there is one it's not the last page
+    bool more = (uint)messages->count() > req.amount;
 
-    if (!valueCorrect || amount <= 0 || amount > maxMessageAmount)
+    while ((uint)messages->count() > req.amount)
     {
-        client->sendMessage("FAIL 299 #Bad amount parameter");
-        return;
+        if (req.cursor == LogAfter)
+            messages->removeLast();
+        else
+            messages->removeFirst();
     }
 
-    uint offset = messageOffset.toInt(&valueCorrect);
+    // LOGCUR <direction> <next cursor> <1 if there's more> : pass the cursor back to get the next page
+    int next = cursor;
+    if (!messages->isEmpty())
+        next = (req.cursor == LogAfter) ? messages->last().id : messages->first().id;
 
-    if (!valueCorrect || offset <= 0 || offset >= AirinDatabase::db->lastMessage())
+    sendLogMessages(req, messages, QStringList() << roomFrame(req.room, QString("LOGCUR %1 %2 %3 #")
+                                                              .arg((req.cursor == LogAfter) ? "AFTER" : "BEFORE")
+                                                              .arg(next)
+                                                              .arg(more ? 1 : 0)));
+}
+
+QList<AirinMessage> *AirinServer::historyMessages(const AirinLogRequest &req)
+{
+    if (history.capacity() <= 0)
+        return NULL;
+
+    // Rooms are loaded into the buffer once, on the first request that misses it.
+    // Database workers do it in the background, the request goes to SQL meanwhile
+    if (!history.isSeeded(req.room) && !dbWorkers.isEmpty())
     {
-        log (QString("Client requested no or wrong offset, will send last %1 messages.").arg(amount));
-        offset = -1;
+        if (!seedingRooms.contains(req.room))
+        {
+            seedingRooms.insert(req.room);
+            QMetaObject::invokeMethod(nextDatabaseWorker(), "fetchRecent", Qt::QueuedConnection,
+                                      Q_ARG(QString, req.room),
+                                      Q_ARG(int, history.capacity()));
+        }
+
+        return NULL;
     }
 
-    AirinLogRequest req;
-    req.amount = amount;
-    req.from = offset;
-    req.order = order;
-    req.client = client;
+    if (!history.isSeeded(req.room))
+    {
+        QList<AirinMessage> *recent = AirinDatabase::db->getRecentMessages(history.capacity(), req.room);
 
+        if (recent == NULL)
+            return NULL;
 
-    if (useLogRequestQueue)
-        enqueueLogRequest(req);
-    else
-        respondLogRequest(req);
+        log (QString("Seeding history of room %1 with %2 messages").arg(req.room).arg(recent->count()));
+        history.seed(req.room, *recent);
+        delete recent;
+    }
+
+    QList<AirinMessage> *messages = new QList<AirinMessage>();
+
+    if (!history.fetch(messages, req.amount, (int)req.from, req.client->externalId(), req.room))
+    {
+        delete messages;
+        return NULL;
+    }
 
+    log (QString("Served %1 messages from the history buffer").arg(messages->count()));
+    return messages;
 }
 
-void AirinServer::enqueueLogRequest(AirinLogRequest req)
+void AirinServer::databaseRecentFetched(QString room, int amount, AirinMessageList messages, bool ok)
 {
-    if (!req.client->isReady())
+    seedingRooms.remove(room);
+
+    // The next request that misses will try again
+    if (!ok)
         return;
 
-    if ((uint)logRequests.count() < maxLogQueryQueueLength)
-        logRequests.append(req);
-    else
-        req.client->sendMessage("FAIL 299 #Log request queue is full, wait plz");
+    // Buffer size changed meanwhile, this answer does not fit it anymore
+    if (amount != history.capacity() || history.isSeeded(room))
+        return;
+
+    log (QString("Seeding history of room %1 with %2 messages").arg(room).arg(messages.count()));
+    history.seed(room, messages);
 }
 
-void AirinServer::respondLogRequest(AirinLogRequest req)
+void AirinServer::mergeUnsavedMessages(QList<AirinMessage> *messages, const AirinLogRequest &req)
 {
-    // This is the best and fault-free way to check is our client is still valid.
-    // If you know a better way to check the object existence and validity in C++/Qt
-    // feel free to send us a pull request at github.com/asterleen/airin
-    if (clients.indexOf(req.client) == -1)
-    {
-        log ("Trying to send logs to a disconnected client, aborting");
+    QList<AirinMessage> unsaved = messageWriter->unsaved(req.room);
+    if (unsaved.isEmpty())
         return;
-    }
 
-    QList<AirinMessage> *messages;
+    int from = (int)req.from; // -1 means "last N messages"
 
-    if (req.from > 0)
-    {
-        messages = AirinDatabase::db->getMessages(req.amount, req.from, req.client->externalId());
-    }
-        else // user requested just last N messages
-    {
-        messages = AirinDatabase::db->getMessages(req.amount, 0, req.client->externalId());
-    }
+    // A batch may be committed already but not yet forgotten by the writer
+    QSet<int> known;
+    for (int i = 0; i < messages->count(); i++)
+        known.insert(messages->at(i).id);
 
-    if (messages == NULL)
+    for (int i = 0; i < unsaved.count(); i++)
     {
-        log ("Database returned bad messages list", LL_WARNING);
-        return;
+        const AirinMessage &msg = unsaved.at(i);
+
+        if (known.contains(msg.id) || (from > 0 && msg.id < from))
+            continue;
+
+        if (!msg.visible && msg.login != req.client->externalId())
+            continue;
+
+        messages->append(msg);
     }
 
-    int msCnt = messages->count(); // just caching, nothing special
-    if (msCnt > 0)
+    std::sort(messages->begin(), messages->end(), messageIdLessThan);
+
+    // Same window as the database would give: first N from the offset or last N at all
+    while ((uint)messages->count() > req.amount)
     {
-        if (req.order == LogDescend)
-        {
-            for (int i = msCnt - 1; i >= 0; i--)
-            {
-                req.client->sendMessage(QString("LOGCON %1 %2 %3 %4 %5 #%6")
-                                    .arg(messages->at(i).id)
-                                    .arg(messages->at(i).timestamp.toTime_t())
-                                    .arg((messages->at(i).name.isEmpty())
-                                         ? defaultUserName : messages->at(i).name)
-                                    .arg (messages->at(i).color.isEmpty()
-                                         ? "NULL" : messages->at(i).color)
-                                    .arg(discloseUserIds ? messages->at(i).login : "null")
-                                    .arg(messages->at(i).message));
-            }
-        }
+        if (from > 0)
+            messages->removeLast();
         else
-        {
-            for (int i = 0; i < msCnt; i++)
-            {
-                req.client->sendMessage(QString("LOGCON %1 %2 %3 %4 %5 #%6")
-                                    .arg(messages->at(i).id)
-                                    .arg(messages->at(i).timestamp.toTime_t())
-                                    .arg((messages->at(i).name.isEmpty())
-                                         ? defaultUserName : messages->at(i).name)
-                                    .arg (messages->at(i).color.isEmpty()
-                                         ? "NULL" : messages->at(i).color)
-                                    .arg(discloseUserIds ? messages->at(i).login : "null")
-                                    .arg(messages->at(i).message));
-            }
-        }
-    }
-    else
-    {
-        log ("There were no messages matching client's request");
-        req.client->sendMessage("FAIL 206 #No messages");
+            messages->removeFirst();
     }
-
-    delete messages;
 }
 
 void AirinServer::sendGreeting(AirinClient *client)
@@ -944,24 +2017,101 @@ void AirinServer::sendGreeting(AirinClient *client)
     client->sendMessage("REM #(______)__m_m)");
 }
 
-void AirinServer::messageBroadcast(QString message, uint apiLevel)
+void AirinServer::messageBroadcast(QString message, uint apiLevel, QString room)
 {
     log (QString("Broadcast message for %1 clients: %2").arg(clients.count()).arg(message));
 
-    for (int i = 0; i < clients.count(); i++)
+    AirinBroadcast payload(room.isEmpty() ? message : roomFrame(room, message), apiLevel);
+    payload.room = room;
+    broadcast(payload);
+}
+
+QString AirinServer::roomFrame(const QString &room, const QString &frame)
+{
+    // Default room keeps the old framing, so clients that never JOIN don't notice rooms at all
+    if (room.isEmpty() || room == AIRIN_DEFAULT_ROOM)
+        return frame;
+
+    return QString("IN %1 %2").arg(room).arg(frame);
+}
+
+void AirinServer::contentBroadcast(QString message, QString room, const QByteArray &binary)
+{
+    if (contentBatchWindow == 0 || contentBatchTimer == NULL)
     {
-        if (clients.at(i)->isAuthorized() || clients.at(i)->isReadonly())
-        {
-            if (apiLevel == 0 ||
-               (apiLevel > 0 && clients.at(i)->apiLevel() >= apiLevel))
-                    clients.at(i)->sendMessage(message);
-        }
+        log (QString("Broadcast message for %1 clients: %2").arg(clients.count()).arg(message));
+
+        AirinBroadcast payload(roomFrame(room, message));
+        payload.room = room;
+        payload.binary = binary;
+        payload.droppable = true;
+        broadcast(payload);
+        return;
     }
+
+    // Older clients still get every line in its own frame right now
+    AirinBroadcast payload(roomFrame(room, message));
+    payload.maxApiLevel = AIRIN_BATCH_API_LEVEL - 1;
+    payload.room = room;
+    payload.droppable = true;
+    broadcast(payload);
+
+    QStringList &batch = contentBatches[room];
+
+    // Binary records are glued together only while every line of the batch has one
+    if (binary.isEmpty())
+        contentBinaryBatches.remove(room);
+    else
+    if (batch.isEmpty())
+        contentBinaryBatches.insert(room, binary);
+    else
+    if (contentBinaryBatches.contains(room))
+        contentBinaryBatches[room].append(binary);
+
+    batch.append(message);
+
+    if (batch.count() >= AIRIN_BATCH_MAX_LINES)
+        flushContentBatch();
+    else
+    if (!contentBatchTimer->isActive())
+        contentBatchTimer->start(contentBatchWindow);
 }
 
-bool AirinServer::chkString(const QString &s)
+void AirinServer::flushContentBatch()
 {
-    return (s.indexOf('#') > -1);
+    if (contentBatches.isEmpty())
+        return;
+
+    // Take the batches first, broadcast() flushes non-empty ones itself
+    QMap<QString, QStringList> batches = contentBatches;
+    QMap<QString, QByteArray> binaryBatches = contentBinaryBatches;
+    contentBatches.clear();
+    contentBinaryBatches.clear();
+    contentBatchTimer->stop();
+
+    QMap<QString, QStringList>::const_iterator it;
+    for (it = batches.constBegin(); it != batches.constEnd(); ++it)
+    {
+        const QStringList &lines = it.value();
+
+        // [IN <room>] BATCH <count> <length1>,<length2>,... #<line1><line2>...
+        // Lengths are in UTF-16 code units, so a line may contain anything
+        QStringList lengths;
+        for (int i = 0; i < lines.count(); i++)
+            lengths.append(QString::number(lines.at(i).length()));
+
+        log (QString("Flushing a batch of %1 CONTENT lines for room %2").arg(lines.count()).arg(it.key()));
+
+        AirinBroadcast payload(roomFrame(it.key(), QString("BATCH %1 %2 #%3")
+                                         .arg(lines.count())
+                                         .arg(lengths.join(","))
+                                         .arg(lines.join(QString()))),
+                               AIRIN_BATCH_API_LEVEL);
+        payload.room = it.key();
+        payload.binary = binaryBatches.value(it.key()); // binary clients get all the records in one message
+        payload.droppable = true;
+        broadcast(payload);
+    }
 }
 
 bool AirinServer::checkAuth(AirinClient *client)
@@ -979,9 +2129,9 @@ bool AirinServer::isNameDistinct(AirinClient *client)
 {
     QString name = client->chatName().toLower();
 
-    for (int i = 0; i < clients.length(); i++)
+    for (AirinClientRegistry::const_iterator i = clients.begin(); i != clients.end(); ++i)
     {
-        AirinClient *tmpClient = clients.at(i); // cache
+        AirinClient *tmpClient = i.key(); // cache
 
         if (client->externalId() != tmpClient->externalId() &&
             tmpClient->chatName() != defaultUserName &&
@@ -1039,14 +2189,31 @@ void AirinServer::serverNewConnection()
         connect (client, SIGNAL(initTimeout()), this, SLOT(clientInitTimeout()));
         connect (client, SIGNAL(pingTimeout()), this, SLOT(clientPingTimeout()));
         connect (client, SIGNAL(pingMissed()), this, SLOT(clientPingMissed()));
+        connect (client, SIGNAL(sendQueueDropped(uint)), this, SLOT(clientSendQueueDropped(uint)));
+        connect (client, SIGNAL(sendQueueEvicted()), this, SLOT(clientSendQueueEvicted()));
 
         log ("Setting client's default values...");
 
         client->setColorResetsMax(colorResetMax);
+        client->setSendQueueLimits(sendQueueMaxBytes, sendQueueMaxFrames, sendQueuePolicy);
         client->setChatName(defaultUserName);
-        clients.append(client);
+        clients.add(client);
+        clients.join(client, AIRIN_DEFAULT_ROOM);
+
+        // In single-thread mode a closed client deletes itself, so forget it right then
+        if (ioWorkers.isEmpty())
+            connect (client, SIGNAL(destroyed(QObject*)), this, SLOT(clientDestroyed(QObject*)));
+
+        if (!ioWorkers.isEmpty())
+        {
+            // TLS handshake is already done here, further socket I/O goes to the worker
+            log (QString("Handing client's socket to I/O thread #%1").arg(nextIoWorker));
+            ioWorkers.at(nextIoWorker)->adopt(client, sock);
+            nextIoWorker = (nextIoWorker + 1) % ioWorkers.count();
+        }
+
         log (QString("Client [%1:%2 / %3] initialized successfully, greeting him and starting INIT process.")
-             .arg(clients.indexOf(client)).arg(client->hash()).arg(client->remoteAddress()), LL_INFO);
+             .arg(clients.handle(client)).arg(client->hash()).arg(client->remoteAddress()), LL_INFO);
 
         log (QString ("Setting a timeout watchdog for %1 ms...").arg(initTimeout));
         client->setInitTimeout(initTimeout);
@@ -1058,10 +2225,234 @@ void AirinServer::serverNewConnection()
 
 }
 
+void AirinServer::setMessageVisible(const AirinMessage &message, bool visible)
+{
+    history.setVisible(message.id, visible);
+    history.logChange(message.room, message.id, visible, (int)AirinDatabase::db->lastMessage());
+
+    logCache.invalidate(message.room);
+
+    if (!visible)
+        hiddenAuthors.insert(message.login);
+}
+
+quint64 AirinServer::historyHits()
+{
+    return history.hits();
+}
+
+quint64 AirinServer::historyMisses()
+{
+    return history.misses();
+}
+
+quint64 AirinServer::logCacheHits()
+{
+    return logCache.hits();
+}
+
+quint64 AirinServer::logCacheMisses()
+{
+    return logCache.misses();
+}
+
+void AirinServer::setupDatabaseWorkers()
+{
+    nextDbWorker = 0;
+
+    if (dbThreadsCount == 0 || !dbWorkers.isEmpty())
+        return;
+
+    // Only CONNECT and LOG go there, they are the ones that come in thousands.
+    // Admin commands are rare and still ask AirinDatabase::db directly.
+    log (QString("Starting %1 database threads...").arg(dbThreadsCount), LL_INFO);
+
+    for (uint i = 0; i < dbThreadsCount; i++)
+    {
+        AirinDatabaseWorker *worker = new AirinDatabaseWorker(i);
+        worker->setDatabase(AirinDatabase::typeByName(sqlDbType),
+                            sqlHost, sqlDatabase, sqlUsername, sqlPassword);
+        worker->setRetryTimeout(databaseRetryTimeout);
+
+        if (useReplica)
+            worker->setReplica(replicaHost, replicaDatabase, replicaUsername, replicaPassword,
+                               replicaRetryTimeout);
+
+        connect (worker, SIGNAL(authLookedUp(quint64,AirinAuthResult)),
+                 this, SLOT(databaseAuthLookedUp(quint64,AirinAuthResult)));
+        connect (worker, SIGNAL(logFetched(AirinLogRequest,AirinMessageList,bool)),
+                 this, SLOT(databaseLogFetched(AirinLogRequest,AirinMessageList,bool)));
+        connect (worker, SIGNAL(recentFetched(QString,int,AirinMessageList,bool)),
+                 this, SLOT(databaseRecentFetched(QString,int,AirinMessageList,bool)));
+        connect (worker, SIGNAL(hiddenAuthorsFetched(QStringList,bool)),
+                 this, SLOT(databaseHiddenAuthorsFetched(QStringList,bool)));
+        connect (worker, SIGNAL(messagesArchived(int)), this, SLOT(messagesArchived(int)));
+
+        worker->start();
+        dbWorkers.append(worker);
+    }
+}
+
+AirinDatabaseWorker *AirinServer::nextDatabaseWorker()
+{
+    AirinDatabaseWorker *worker = dbWorkers.at(nextDbWorker);
+    nextDbWorker = (nextDbWorker + 1) % dbWorkers.count();
+
+    return worker;
+}
+
+void AirinServer::setupMessageWriter()
+{
+    if (!useWriteBehind || messageWriter != NULL)
+        return;
+
+    log (QString("Messages will be saved in the background every %1 ms, up to %2 may wait for it")
+         .arg(writeBehindInterval).arg(writeBehindMaxQueue), LL_INFO);
+
+    messageWriter = new AirinMessageWriter();
+    messageWriter->setDatabase(AirinDatabase::typeByName(sqlDbType),
+                               sqlHost, sqlDatabase, sqlUsername, sqlPassword);
+    messageWriter->setFlushInterval(writeBehindInterval);
+    messageWriter->setMaxQueue(writeBehindMaxQueue);
+
+    connect (messageWriter, SIGNAL(flushed(int,qint64)), this, SLOT(messageWriterFlushed(int,qint64)));
+    connect (messageWriter, SIGNAL(flushFailed(QString)), this, SLOT(messageWriterFailed(QString)));
+    connect (messageWriter, SIGNAL(messagesDropped(QList<int>)), this, SLOT(messagesDropped(QList<int>)));
+
+    messageWriter->start();
+}
+
+void AirinServer::setupPgPipeline()
+{
+    if (!useAsyncPostgres || pgPipeline != NULL)
+        return;
+
+    if (useWriteBehind)
+    {
+        log ("Write-behind is on, it saves messages by itself, the async PostgreSQL connection is not used", LL_WARNING);
+        return;
+    }
+
+#ifdef AIRIN_LIBPQ
+    pgPipeline = new AirinPgPipeline(this);
+
+    connect (pgPipeline, SIGNAL(messageAdded(quint64,int)), this, SLOT(pipelineMessageAdded(quint64,int)));
+    connect (pgPipeline, SIGNAL(connectionLost()), this, SLOT(pipelineLost()));
+
+    if (!pgPipeline->start(sqlHost, sqlDatabase, sqlUsername, sqlPassword))
+    {
+        log ("Async PostgreSQL is not available, messages will be saved with QPSQL", LL_WARNING);
+        delete pgPipeline;
+        pgPipeline = NULL;
+    }
+#else
+    log ("This Airin is built without libpq (CONFIG+=airin_libpq), pgsql-async works just like pgsql", LL_ERROR);
+#endif
+}
+
+void AirinServer::pipelineMessageAdded(quint64 ticket, int messageId)
+{
+#ifdef AIRIN_LIBPQ
+    if (!pipelinePosts.contains(ticket))
+        return;
+
+    AirinPendingPost post = pipelinePosts.take(ticket);
+    post.message.id = messageId;
+
+    // Lost together with the connection, not rejected by the server, so one more try
+    if (messageId < 0 && !pgPipeline->isActive())
+        post.message.id = AirinDatabase::db->addMessage(post.message.login, post.message.message,
+                                                        post.message.name, post.message.color,
+                                                        post.message.visible, post.message.room);
+    else
+        AirinDatabase::raiseLastMessageId(messageId);
+
+    deliverMessage(clients.byHandle(post.clientHandle), post.recCode, post.message);
+#else
+    Q_UNUSED(ticket)
+    Q_UNUSED(messageId)
+#endif
+}
+
+void AirinServer::pipelineLost()
+{
+#ifdef AIRIN_LIBPQ
+    // Messages go through QPSQL until the next database setup
+    log ("Async PostgreSQL connection is lost, messages will be saved with QPSQL", LL_WARNING);
+
+    pgPipeline->deleteLater(); // we may be inside of its own call
+    pgPipeline = NULL;
+#endif
+}
+
+void AirinServer::archiveMessages()
+{
+    if (archiveAfterDays == 0 || archiveRunning || !useXAuth)
+        return;
+
+    archiveRunning = true;
+    log (QString("Archiving messages older than %1 days...").arg(archiveAfterDays));
+
+    // It's a big DELETE, better not to do it on the main thread if there's a choice
+    if (!dbWorkers.isEmpty())
+        QMetaObject::invokeMethod(nextDatabaseWorker(), "archiveMessages", Qt::QueuedConnection,
+                                  Q_ARG(uint, archiveAfterDays),
+                                  Q_ARG(int, archiveBatchSize));
+    else
+        messagesArchived(AirinDatabase::db->archiveMessages(archiveAfterDays, archiveBatchSize));
+}
+
+void AirinServer::messagesArchived(int count)
+{
+    archiveRunning = false;
+
+    if (count < 0)
+    {
+        log ("Message archival failed, will try again later", LL_WARNING);
+        return;
+    }
+
+    if (count > 0)
+        log (QString("%1 old messages are moved to the archive").arg(count), LL_INFO);
+
+    // A full batch means there's more, the first run on a big table takes a while
+    if (count >= (int)archiveBatchSize)
+        QTimer::singleShot(1000, this, SLOT(archiveMessages()));
+}
+
+void AirinServer::messageWriterFlushed(int count, qint64 elapsed)
+{
+    log (QString("Saved %1 messages in %2 ms").arg(count).arg(elapsed));
+}
+
+void AirinServer::messageWriterFailed(QString error)
+{
+    log ("Could not save messages, will retry: "+error, LL_WARNING);
+}
+
+void AirinServer::messagesDropped(QList<int> ids)
+{
+    if (ids.isEmpty())
+        return;
+
+    std::sort(ids.begin(), ids.end());
+
+    // These were delivered to clients already, but they won't appear in logs
+    log (QString("%1 messages (%2..%3) could not be saved and are lost")
+         .arg(ids.count()).arg(ids.first()).arg(ids.last()), LL_ERROR);
+
+    logAdmin(QString("WARNING! %1 messages (IDs %2..%3) are lost because of database errors!")
+             .arg(ids.count()).arg(ids.first()).arg(ids.last()), LL_ERROR);
+
+    // Don't serve them from memory either, LOG and SYNC must match the database
+    history.forget(ids);
+    logCache.clear();
+}
+
 void AirinServer::clientMessage(QString message)
 {
     AirinClient *client = (AirinClient *)QObject::sender();
-    log (QString("Client [%3:%1] says '%2'").arg(client->hash()).arg(message).arg(clients.indexOf(client)));
+    log (QString("Client [%3:%1] says '%2'").arg(client->hash()).arg(message).arg(clients.handle(client)));
 
     processClientCommand(client, message);
 }
@@ -1070,18 +2461,26 @@ void AirinServer::clientDisconnect()
 {
      AirinClient *client = (AirinClient *)QObject::sender();
      log (QString("Client [%3:%1 / %2] leaves us...").arg(client->hash()).arg(client->remoteAddress())
-          .arg(clients.indexOf(client)), LL_INFO);
+          .arg(clients.handle(client)), LL_INFO);
 
-     clients.removeAt(clients.indexOf(client));
+     logScheduler.remove(clients.handle(client));
+     clients.remove(client);
      client->deleteLater();
 }
 
+void AirinServer::clientDestroyed(QObject *object)
+{
+    // Object is dead already, the pointer is only used as a key here
+    logScheduler.remove(clients.handle((AirinClient *)object));
+    clients.remove((AirinClient *)object);
+}
+
 void AirinServer::clientInitTimeout()
 {
     AirinClient *client = (AirinClient *)QObject::sender();
 
     log (QString("Client [%3:%1 / %2] did not pass neccessary init process, disconnecting him.").arg(client->hash()).arg(client->remoteAddress())
-         .arg(clients.indexOf(client)), LL_WARNING);
+         .arg(clients.handle(client)), LL_WARNING);
 
     logAdmin(QString("Client %1 did not pass neccessary init process, disconnecting him!")
                     .arg(client->remoteAddress()), LL_WARNING);
@@ -1105,6 +2504,24 @@ void AirinServer::clientPingMissed()
     client->close();
 }
 
+void AirinServer::clientSendQueueDropped(uint frames)
+{
+    AirinClient *client = (AirinClient *)QObject::sender();
+    sendQueueDropsCount += frames;
+
+    log (QString("Client [%1] reads too slowly, dropped %2 chat lines from its queue")
+         .arg(client->hash()).arg(frames), LL_WARNING);
+}
+
+void AirinServer::clientSendQueueEvicted()
+{
+    AirinClient *client = (AirinClient *)QObject::sender();
+    sendQueueEvictionsCount++;
+
+    logAdmin(QString("Client %1 (%2) disconnected because it reads too slowly")
+                    .arg(client->externalId()).arg(client->hash()), LL_WARNING);
+}
+
 void AirinServer::serverRestart()
 {
     qApp->quit();
@@ -1113,11 +2530,60 @@ void AirinServer::serverRestart()
 
 void AirinServer::flushLogRequestQueue()
 {
-    if (logRequests.count() > 0)
+    QElapsedTimer timer;
+    timer.start();
+
+    // At least one request per tick as before, then as many as fit into the budget
+    AirinLogRequest req;
+    int served = 0;
+
+    while ((served == 0 || (uint)timer.elapsed() < logQueueBudget) && logScheduler.next(&req))
+    {
+        respondLogRequest(req);
+        served++;
+    }
+
+    if (served > 1)
+        log (QString("Served %1 queued log requests in %2 ms, %3 left")
+             .arg(served).arg(timer.elapsed()).arg(logScheduler.count()));
+}
+
+void AirinServer::loadHiddenAuthors()
+{
+    // Read once, then processMessage() and setMessageVisible() keep it up to date,
+    // so a database reconnect does not need it again
+    if (hiddenAuthorsKnown || hiddenAuthorsLoading)
+        return;
+
+    if (!dbWorkers.isEmpty())
+    {
+        hiddenAuthorsLoading = true;
+        QMetaObject::invokeMethod(nextDatabaseWorker(), "fetchHiddenAuthors", Qt::QueuedConnection);
+        return;
+    }
+
+    bool ok;
+    QStringList logins = AirinDatabase::db->hiddenAuthors(&ok);
+    databaseHiddenAuthorsFetched(logins, ok);
+}
+
+void AirinServer::databaseHiddenAuthorsFetched(QStringList logins, bool ok)
+{
+    hiddenAuthorsLoading = false;
+
+    // Without it nobody can be sure to see no hidden messages, so the LOG cache stays unused
+    if (!ok)
     {
-        respondLogRequest(logRequests.first());
-        logRequests.removeFirst();
+        log ("Could not find out who has hidden messages, LOG cache is disabled for now", LL_WARNING);
+        QTimer::singleShot(databaseRetryTimeout, this, SLOT(loadHiddenAuthors()));
+        return;
     }
+
+    // Some may have been added while the query ran
+    hiddenAuthors.unite(QSet<QString>::fromList(logins));
+    hiddenAuthorsKnown = true;
+
+    log (QString("%1 users have hidden messages").arg(hiddenAuthors.count()));
 }
 
 void AirinServer::setupDatabase()
@@ -1127,7 +2593,20 @@ void AirinServer::setupDatabase()
         databaseReconnectCount = 0;
 
         log ("Database connection established.", LL_INFO);
+
+        // Serving with an old schema would fail every message and LOG query
+        if (!AirinDatabase::db->migrate(autoMigrate))
+        {
+            log ("Database schema is not up to date, see the warnings above! "
+                 "Apply the migrations or set 'migrate' in [database] section. Airin will exit!", LL_ERROR);
+            exit(2);
+        }
+
         loadConfigFromDatabase();
+        setupDatabaseWorkers();
+        loadHiddenAuthors();
+        setupMessageWriter();
+        setupPgPipeline();
         setupServer();
     }
     else
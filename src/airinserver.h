@@ -13,10 +13,14 @@
 #include <QStringList>
 #include <QDateTime>
 #include <QMap>
+#include <QHash>
+#include <QSet>
+#include <QQueue>
 #include <QFile>
 #include <QRegExp>
 #include <QSettings>
 #include <QTimer>
+#include <QElapsedTimer>
 
 #include <QWebSocket>
 #include <QWebSocketServer>
@@ -32,13 +36,39 @@
 #include "airinclient.h"
 #include "airindatabase.h"
 #include "airincommands.h"
+#include "airinworker.h"
+#include "airinregistry.h"
+#include "airinmessagewriter.h"
+#include "airinhistory.h"
+#include "airindatabaseworker.h"
+#include "airinframe.h"
+#include "airinbinaryframe.h"
+#include "airinlogscheduler.h"
+#include "airinlogcache.h"
 
 
 // Now the Cores of Airin Opensource and Provodach's one are on the same level
 #define AIRIN_VERSION "4.6.6-opensource"
-#define AIRIN_MAX_API_LEVEL 3
+#define AIRIN_MAX_API_LEVEL 5
 #define AIRIN_MIN_API_LEVEL 2
 
+// Since this level CONTENT lines are delivered in batches
+#define AIRIN_BATCH_API_LEVEL 4
+#define AIRIN_BATCH_MAX_LINES 64
+
+// Since this level clients can join rooms other than the default one
+#define AIRIN_ROOMS_API_LEVEL 4
+
+// Since this level LOG BEFORE|AFTER <id> <amount> pages with a cursor
+#define AIRIN_CURSOR_API_LEVEL 4
+
+// Since this level clients may ask for binary chat lines, see AirinBinaryFrame
+#define AIRIN_BINARY_API_LEVEL 5
+
+// Since this level every LOG answer ends with LOGEND
+#define AIRIN_LOGEND_API_LEVEL 5
+
+class AirinPgPipeline; // only built with CONFIG+=airin_libpq
 
 class AirinServer : public QObject
 {
@@ -53,13 +83,21 @@ public:
     void disconnectClientsByXId(QString externalId);
     void disconnectClientsByAddress (QString address);
     void disconnectClientsByHash (QString hash);
-    void messageBroadcast(QString message, uint apiLevel = 0);
+    void messageBroadcast(QString message, uint apiLevel = 0, QString room = QString());
     void broadcastForXId (QString externalId, QString message);
+    void broadcast (const AirinBroadcast &payload, const QString &externalId = QString());
     void setShadowbanned (QString externalId, bool isShBanned);
     void setMotd(QString newMotd);
     QString defaultChatName();
     bool isOnline (QString externalId);
     bool isNameDistinct(AirinClient *client);
+    uint sendQueueEvictions();
+    uint sendQueueDrops();
+    void setMessageVisible(const AirinMessage &message, bool visible);
+    quint64 historyHits();
+    quint64 historyMisses();
+    quint64 logCacheHits();
+    quint64 logCacheMisses();
     void loadConfigFromDatabase();
 
 
@@ -77,12 +115,33 @@ private:
     uint sqlServerPing;
     uint initTimeout;
     uint logQueueFlushTimeout;
+    uint logQueueBudget;
     uint colorResetMax;
     uint clientPingPollInterval;
     uint clientPingMissTolerance;
     uint databaseRetryTimeout;
     uint maxDatabaseReconnectCount;
     uint databaseReconnectCount;
+    uint ioThreadsCount;
+    uint dbThreadsCount;
+    uint nextDbWorker;
+    uint contentBatchWindow;
+    uint maxRoomsPerClient;
+    uint logChunkSize;
+    uint archiveAfterDays;
+    uint archiveBatchSize;
+    uint archiveInterval;
+    bool archiveRunning;
+    uint writeBehindInterval;
+    uint historySize;
+    uint writeBehindMaxQueue;
+    uint compressionMinSize;
+    uint sendQueueMaxBytes;
+    uint sendQueueMaxFrames;
+    uint sendQueueEvictionsCount;
+    uint sendQueueDropsCount;
+    AirinClient::SendQueuePolicy sendQueuePolicy;
+    uint nextIoWorker;
     bool serverSecure;
     bool delayTroll; // block user again and again by resetting the delay time counter
     bool useXAuth;
@@ -95,6 +154,11 @@ private:
     bool useMiscInfoAsName; // web-frontend must write appropriate content in `misc_info` field of `auth` table
     bool useLogRequestQueue;
     bool useXffHeader; // should we trust X-Forwarded-For header in WS handshake?
+    bool useCompression; // clients may ask for compressed binary frames with COMPRESS
+    bool autoMigrate;
+    bool useWriteBehind; // messages are broadcast first and saved by AirinMessageWriter later
+    bool useAsyncPostgres; // dbms = pgsql-async, messages are inserted by AirinPgPipeline
+    bool useReplica; // [database_replica] serves reads while it's alive
     QString hashSalt;
     QString logFile;
     QString sqlDbType;
@@ -102,6 +166,11 @@ private:
     QString sqlDatabase;
     QString sqlUsername;
     QString sqlPassword;
+    QString replicaHost;
+    QString replicaDatabase;
+    QString replicaUsername;
+    QString replicaPassword;
+    uint replicaRetryTimeout;
     QString sslCertFile;
     QString sslIntermediateCertFile;
     QString sslKeyFile;
@@ -109,11 +178,29 @@ private:
     QString deprecationMessage;
 
     QMap<QString, uint> lastMessageTime;
-    QList<AirinLogRequest> logRequests;
+    AirinLogScheduler logScheduler;
+    AirinLogCache logCache;
+    QSet<QString> hiddenAuthors; // logins that have hidden (removed or shadowbanned) messages
+    bool hiddenAuthorsKnown;
+    bool hiddenAuthorsLoading;
     QTimer *logRequestQueueTimer;
+    QMap<QString, QStringList> contentBatches; // room => lines
+    QMap<QString, QByteArray> contentBinaryBatches; // room => the same lines as binary records
+    QTimer *contentBatchTimer;
+    QTimer *archiveTimer;
+    QHash<quint64, QQueue<AirinLogStream> > logStreams; // client handle => its LOG answers, in order
+    QQueue<quint64> logStreamOrder; // clients take turns, one chunk each
+    QTimer *logStreamTimer;
 
     QWebSocketServer *server;
-    QList<AirinClient *> clients;
+    AirinClientRegistry clients;
+    QList<AirinWorker *> ioWorkers;
+    QList<AirinDatabaseWorker *> dbWorkers;
+    AirinMessageWriter *messageWriter;
+    AirinPgPipeline *pgPipeline;
+    QHash<quint64, AirinPendingPost> pipelinePosts; // ticket => post
+    AirinHistory history;
+    QSet<QString> seedingRooms; // asked a database worker for their history already
 
     QSslConfiguration sslConfiguration;
 
@@ -122,18 +209,64 @@ private:
     void loadConfig(QString configName);
     void setupSsl();
     void setupServer();
-
-    void processClientCommand (AirinClient *client, QString command);
-    void processMessage (AirinClient *client, QString recCode, QString message);
+    void setupIoWorkers();
+    void setupMessageWriter();
+    void setupPgPipeline();
+    void setupDatabaseWorkers();
+    AirinDatabaseWorker *nextDatabaseWorker();
+
+    void processClientCommand (AirinClient *client, QString command, QString room = AIRIN_DEFAULT_ROOM);
+
+    struct CommandHandler
+    {
+        uint minApiLevel;
+        bool (AirinServer::*handler)(AirinClient *client, const AirinFrame &frame, const QString &room);
+    };
+
+    static const CommandHandler commandTable[AirinFrame::CmdCount];
+
+    bool processRoomScope (AirinClient *client, const AirinFrame &frame, const QString &room);
+    bool processConnect (AirinClient *client, const AirinFrame &frame, const QString &room);
+    bool processLevel (AirinClient *client, const AirinFrame &frame, const QString &room);
+    bool processContent (AirinClient *client, const AirinFrame &frame, const QString &room);
+    bool processIam (AirinClient *client, const AirinFrame &frame, const QString &room);
+    bool processLog (AirinClient *client, const AirinFrame &frame, const QString &room);
+    bool processAuthChange (AirinClient *client, const AirinFrame &frame, const QString &room);
+    bool processGetset (AirinClient *client, const AirinFrame &frame, const QString &room);
+    bool processSus (AirinClient *client, const AirinFrame &frame, const QString &room);
+    bool processCompress (AirinClient *client, const AirinFrame &frame, const QString &room);
+    bool processRoomChange (AirinClient *client, const AirinFrame &frame, const QString &room);
+    bool processSync (AirinClient *client, const AirinFrame &frame, const QString &room);
+
+    void finishAuth (AirinClient *client, const AirinAuthResult &auth);
+    void processMessage (AirinClient *client, QString recCode, QString message, QString room);
+    void deliverMessage (AirinClient *client, QString recCode, AirinMessage posted);
     void processMessageAPI (AirinClient *client, QString messageAmount,
-                            QString messageOffset = QString(), LogOrder order = LogAscend);
+                            QString messageOffset = QString(), LogOrder order = LogAscend,
+                            QString room = AIRIN_DEFAULT_ROOM);
 
+    void processLogCursor (AirinClient *client, QString direction, QString cursorId,
+                           QString messageAmount, QString room);
     void enqueueLogRequest (AirinLogRequest req);
     void respondLogRequest (AirinLogRequest req);
+    bool resolveLogRequest (AirinLogRequest *req);
+    void answerLogRequest (const AirinLogRequest &req, QList<AirinMessage> *messages);
+    void sendLogMessages (const AirinLogRequest &req, QList<AirinMessage> *messages,
+                          const QStringList &tail = QStringList());
+    void queueLogStream (quint64 clientHandle, AirinClient *client, AirinLogStream &stream);
+    bool sendLogChunk (AirinClient *client, AirinLogStream &stream);
+    void answerCachedLog (const AirinLogRequest &req, const AirinLogCacheEntry &cached);
+    bool isLogCacheable (const AirinLogRequest &req);
+    QString logFrame (const AirinMessage &message);
+    void sendLogPage (const AirinLogRequest &req, QList<AirinMessage> *messages);
+    void mergeUnsavedMessages (QList<AirinMessage> *messages, const AirinLogRequest &req);
+    QList<AirinMessage> *historyMessages (const AirinLogRequest &req);
 
     void sendGreeting(AirinClient *client);
+    void contentBroadcast(QString message, QString room, const QByteArray &binary);
+    void appendBinaryRecord(QByteArray *out, AirinBinaryFrame::RecordType type, const AirinMessage &message);
+    QString roomFrame(const QString &room, const QString &frame);
 
-    bool chkString(const QString &s);
     bool checkAuth(AirinClient *client);
 
 signals:
@@ -144,17 +277,38 @@ public slots:
 
     void clientMessage(QString message);
     void clientDisconnect();
+    void clientDestroyed(QObject *object);
     void clientInitTimeout();
     void clientPingTimeout();
     void clientPingMissed();
+    void clientSendQueueDropped(uint frames);
+    void clientSendQueueEvicted();
 
     void serverNewConnection();
     void serverRestart();
 
     void flushLogRequestQueue();
+    void flushContentBatch();
+    void pumpLogStreams();
 
     void setupDatabase();
     void databaseOnFault();
+    void loadHiddenAuthors();
+
+    void databaseAuthLookedUp(quint64 clientHandle, AirinAuthResult result);
+    void databaseLogFetched(AirinLogRequest req, AirinMessageList messages, bool ok);
+    void databaseRecentFetched(QString room, int amount, AirinMessageList messages, bool ok);
+    void databaseHiddenAuthorsFetched(QStringList logins, bool ok);
+
+    void messageWriterFlushed(int count, qint64 elapsed);
+    void messageWriterFailed(QString error);
+    void messagesDropped(QList<int> ids);
+
+    void archiveMessages();
+    void messagesArchived(int count);
+
+    void pipelineMessageAdded(quint64 ticket, int messageId);
+    void pipelineLost();
 
 };
 
@@ -0,0 +1,70 @@
+#include "airinworker.h"
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+AirinWorker::AirinWorker(QObject *parent) : QObject(parent)
+{
+    qRegisterMetaType<AirinClientList>("AirinClientList");
+
+    ioThread = new QThread();
+}
+
+AirinWorker::~AirinWorker()
+{
+    stop();
+    delete ioThread;
+}
+
+void AirinWorker::start()
+{
+    // The worker itself lives in its thread so deliveries run there
+    moveToThread(ioThread);
+    ioThread->start();
+}
+
+void AirinWorker::stop()
+{
+    if (ioThread->isRunning())
+    {
+        ioThread->quit();
+        ioThread->wait();
+    }
+}
+
+void AirinWorker::adopt(AirinClient *client, QWebSocket *sock)
+{
+    // Socket goes together with its client and dies with it
+    sock->setParent(client);
+    client->moveToThread(ioThread);
+}
+
+QThread *AirinWorker::workerThread()
+{
+    return ioThread;
+}
+
+void AirinWorker::deliver(AirinClientList recipients, QString message, QByteArray compressed, bool droppable)
+{
+    for (int i = 0; i < recipients.count(); i++)
+    {
+        AirinClient *client = recipients.at(i).data();
+
+        if (client != NULL)
+            client->writeFrame(message, compressed, droppable);
+    }
+}
+
+void AirinWorker::deliverBinary(AirinClientList recipients, QString message, QByteArray data, bool droppable)
+{
+    for (int i = 0; i < recipients.count(); i++)
+    {
+        AirinClient *client = recipients.at(i).data();
+
+        if (client != NULL)
+            client->writeBinary(message, data, droppable);
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef AIRINWORKER_H
+#define AIRINWORKER_H
+
+/*
+        This is Airin 4, an advanced WebSocket chat server
+     Licensed under the new BSD 3-Clause license, see LICENSE
+            Made by Asterleen ~ https://asterleen.com
+*/
+
+#include <QObject>
+#include <QThread>
+#include <QList>
+#include <QPointer>
+#include <QString>
+#include <QByteArray>
+#include <QMetaType>
+
+#include <QWebSocket>
+
+#include "airinclient.h"
+
+// Clients may be deleted while a delivery is queued, so they're guarded
+typedef QList<QPointer<AirinClient> > AirinClientList;
+Q_DECLARE_METATYPE(AirinClientList)
+
+// An I/O worker owns a thread with its own event loop. Sockets of the clients
+// adopted by the worker are served there, while all the chat logic stays
+// on the main thread and talks to the clients through queued calls.
+class AirinWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit AirinWorker(QObject *parent = 0);
+    ~AirinWorker();
+
+    void start();
+    void stop();
+    void adopt(AirinClient *client, QWebSocket *sock);
+
+    QThread *workerThread();
+
+public slots:
+    void deliver(AirinClientList recipients, QString message, QByteArray compressed, bool droppable);
+    void deliverBinary(AirinClientList recipients, QString message, QByteArray data, bool droppable);
+
+private:
+    QThread *ioThread;
+};
+
+#endif // AIRINWORKER_H